@@ -0,0 +1,112 @@
+/*
+ *	USB-RS485 Switch Daemon -- Benchmark of USB Message IDs
+ *
+ *	(c) 2022--2023 Martin Mares <mj@ucw.cz>
+ *
+ *	Compares the ID table in ids.c with the linear search over the list
+ *	of busy messages used before. For each window size, the window is
+ *	kept full: the oldest message gets its reply (the ID is looked up
+ *	and released) and a new message is allocated an ID.
+ *
+ *	Usage: bench-ids [<rounds>]
+ */
+
+#include "daemon.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static u64 now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* The previous implementation: IDs are a counter, collisions and replies are found by scanning busy messages */
+
+static clist linear_busy;
+static u16 linear_last_id;
+
+static void linear_alloc(struct message *m)
+{
+	for (;;) {
+		linear_last_id++;
+		bool used = false;
+		CLIST_FOR_EACH(struct message *, n, linear_busy)
+			if (n != m && n->usb_message_id == linear_last_id) {
+				used = true;
+				break;
+			}
+		if (!used) {
+			m->usb_message_id = linear_last_id;
+			clist_add_tail(&linear_busy, &m->queue_node);
+			return;
+		}
+	}
+}
+
+static struct message *linear_find(u16 id)
+{
+	CLIST_FOR_EACH(struct message *, m, linear_busy)
+		if (m->usb_message_id == id)
+			return m;
+	return NULL;
+}
+
+static double bench_linear(struct message *msgs, uint window, uint rounds)
+{
+	clist_init(&linear_busy);
+	linear_last_id = 0;
+	for (uint i=0; i < window; i++)
+		linear_alloc(&msgs[i]);
+
+	u64 start = now_ns();
+	for (uint r=0; r < rounds; r++) {
+		struct message *m = clist_head(&linear_busy);
+		m = linear_find(m->usb_message_id);
+		clist_remove(&m->queue_node);
+		linear_alloc(m);
+	}
+	return (double) (now_ns() - start) / rounds;
+}
+
+/* The ID table */
+
+static struct id_table table;
+
+static double bench_table(struct message *msgs, uint window, uint rounds)
+{
+	id_table_init(&table);
+	for (uint i=0; i < window; i++)
+		id_alloc(&table, &msgs[i]);
+
+	// Replies arrive in the order of requests, so the oldest message is the next one in the ring
+	u64 start = now_ns();
+	for (uint r=0; r < rounds; r++) {
+		struct message *m = &msgs[r % window];
+		m = id_find(&table, m->usb_message_id);
+		id_free(&table, m);
+		id_alloc(&table, m);
+	}
+	return (double) (now_ns() - start) / rounds;
+}
+
+int main(int argc, char **argv)
+{
+	uint rounds = (argc > 1) ? atoi(argv[1]) : 10000000;
+	static const uint windows[] = { 4, 16, 64 };
+	struct message *msgs = calloc(64, sizeof(struct message));
+
+	printf("window  linear[ns]  table[ns]\n");
+	for (uint i=0; i < ARRAY_SIZE(windows); i++) {
+		uint w = windows[i];
+		double lin = bench_linear(msgs, w, rounds);
+		double tab = bench_table(msgs, w, rounds);
+		printf("%6u  %10.1f  %9.1f\n", w, lin, tab);
+	}
+
+	free(msgs);
+	return 0;
+}
@@ -0,0 +1,79 @@
+/*
+ *	USB-RS485 Switch Daemon -- Circuit Breakers of Dead Slaves
+ *
+ *	(c) 2022--2023 Martin Mares <mj@ucw.cz>
+ */
+
+#include "daemon.h"
+
+/*
+ *  When a slave stops responding, every request for it blocks the channel
+ *  for the whole request timeout of the port. After BreakerThreshold
+ *  consecutive failed transactions, the breaker of the slave opens and
+ *  the scheduler fails its requests immediately, except for a probe let
+ *  through every BreakerProbeInterval milliseconds. Any reply from the
+ *  slave (even an exception) closes the breaker.
+ */
+
+static bool breaker_is_open(struct breaker *b)
+{
+	return (breaker_threshold && b->failures >= breaker_threshold);
+}
+
+bool breaker_allows(struct message *m)
+{
+	// Called by the scheduler before a message is sent
+	struct port *port = m->port;
+	uint unit = m->request[0];
+	struct breaker *b = &port->breakers[unit];
+	if (!unit || !breaker_is_open(b))
+		return true;
+
+	u64 now = get_time_us();
+	if (now < b->probe_at) {
+		port->cnt_breaker_rejects++;
+		return false;
+	}
+
+	DBG("Probing unit %u on port %u", unit, port->port_number);
+	b->probe_at = now + (u64) breaker_probe_interval * 1000;
+	return true;
+}
+
+void breaker_update(struct message *m)
+{
+	// Called for every reply received from the switch
+	struct port *port = m->port;
+	uint unit = m->request[0];
+	if (!unit)
+		return;
+
+	struct breaker *b = &port->breakers[unit];
+	uint err = (m->reply_size >= 3 && (m->reply[1] & 0x80)) ? m->reply[2] : 0;
+	if (err == MODBUS_ERR_GATEWAY_PATH_UNAVAILABLE) {
+		// Not transmitted at all (e.g., cancelled)
+		return;
+	}
+
+	if (err != MODBUS_ERR_GATEWAY_TARGET_DEVICE_FAILED) {
+		if (breaker_is_open(b))
+			msg(L_INFO, "Switch %s: Unit %u on port %u responds again", port->box->cf->name, unit, port->port_number);
+		b->failures = 0;
+		return;
+	}
+
+	// Timeout or a broken reply
+	if (b->failures < 0x7fff)
+		b->failures++;
+	if (breaker_threshold && b->failures == breaker_threshold) {
+		msg(L_WARN, "Switch %s: Unit %u on port %u does not respond, failing its requests", port->box->cf->name, unit, port->port_number);
+		b->probe_at = get_time_us() + (u64) breaker_probe_interval * 1000;
+	}
+}
+
+uint breaker_state(struct port *port, uint unit)
+{
+	// As reported in URS485_IREG_BREAKER_xxx
+	struct breaker *b = &port->breakers[unit];
+	return b->failures | (breaker_is_open(b) ? 0x8000 : 0);
+}
@@ -0,0 +1,123 @@
+/*
+ *	USB-RS485 Switch Daemon -- Cache of Register Reads
+ *
+ *	(c) 2022--2023 Martin Mares <mj@ucw.cz>
+ */
+
+#include "daemon.h"
+
+#include <string.h>
+
+/*
+ *  Replies to reads of holding and input registers are remembered for
+ *  ReadCacheTTL milliseconds (or longer for replies to polls configured
+ *  in the daemon, see poll.c), so that clients polling the same registers
+ *  do not consume bus time. Any write to a slave invalidates all its entries
+ *  and the cache is bypassed for the slave until the write is finished.
+ */
+
+#define CACHE_MAX_ENTRIES 64		// Per port, entries are never freed, only recycled
+
+struct cache_entry {
+	cnode n;			// In port->cache_list, most recently used first
+	u64 expires;			// When the entry becomes stale [μs]
+	uint request_size;
+	byte request[2 + MODBUS_MAX_DATA_SIZE];
+	uint reply_size;
+	byte reply[2 + MODBUS_MAX_DATA_SIZE];
+};
+
+static void cache_drop(struct port *port, struct cache_entry *e)
+{
+	clist_remove(&e->n);
+	port->cache_entries--;
+	clist_add_head(&port->cache_free_list, &e->n);
+}
+
+static void cache_invalidate(struct port *port, uint unit)
+{
+	// Broadcasts (unit 0) invalidate everything
+	struct cache_entry *e, *tmp;
+	CLIST_WALK_DELSAFE(e, port->cache_list, tmp)
+		if (!unit || e->request[0] == unit)
+			cache_drop(port, e);
+}
+
+static bool cache_write_pending(struct message *m)
+{
+	// Replies to reads sent before the write might not reflect it
+	struct port *port = m->port;
+	return (port->pending_writes[m->request[0]] || port->pending_writes[0]);
+}
+
+static struct cache_entry *cache_find(struct message *m)
+{
+	struct port *port = m->port;
+	u64 now = get_time_us();
+
+	struct cache_entry *e, *tmp;
+	CLIST_WALK_DELSAFE(e, port->cache_list, tmp) {
+		if (now >= e->expires)
+			cache_drop(port, e);
+		else if (e->request_size == m->request_size && !memcmp(e->request, m->request, m->request_size))
+			return e;
+	}
+	return NULL;
+}
+
+bool cache_lookup(struct message *m)
+{
+	// Called for every request received from a client
+	if (msg_is_write(m)) {
+		cache_invalidate(m->port, m->request[0]);
+		return false;
+	}
+
+	if (!msg_is_read(m) || cache_write_pending(m))
+		return false;
+
+	struct cache_entry *e = cache_find(m);
+	if (!e)
+		return false;
+
+	clist_remove(&e->n);
+	clist_add_head(&m->port->cache_list, &e->n);
+	m->reply_size = e->reply_size;
+	memcpy(m->reply, e->reply, e->reply_size);
+	m->port->cnt_cache_hits++;
+	return true;
+}
+
+void cache_store(struct message *m)
+{
+	// Called for every reply received from the switch
+	struct port *port = m->port;
+	if (msg_is_write(m)) {
+		// The write has been performed now, replies to reads sent before it are stale
+		cache_invalidate(port, m->request[0]);
+		return;
+	}
+
+	uint ttl = m->poll ? poll_cache_ttl(m->poll) : read_cache_ttl;
+	if (!ttl || !msg_is_read(m) || m->reply_size < 2 || (m->reply[1] & 0x80) || cache_write_pending(m))
+		return;
+
+	struct cache_entry *e = cache_find(m);
+	if (e)
+		clist_remove(&e->n);
+	else if (port->cache_entries < CACHE_MAX_ENTRIES) {
+		e = clist_remove_head(&port->cache_free_list) ? : xmalloc(sizeof(*e));
+		port->cache_entries++;
+	} else {
+		// Recycle the least recently used entry
+		e = clist_tail(&port->cache_list);
+		clist_remove(&e->n);
+	}
+
+	e->expires = get_time_us() + (u64) ttl * 1000;
+	e->request_size = m->request_size;
+	memcpy(e->request, m->request, m->request_size);
+	e->reply_size = m->reply_size;
+	memcpy(e->reply, m->reply, m->reply_size);
+	clist_add_head(&port->cache_list, &e->n);
+}
@@ -21,13 +21,6 @@
 #define CLIENT_MSG(client, level, fmt, ...) msg(level, "Client %d: " fmt, client->id, ##__VA_ARGS__)
 #define CLIENT_DBG(client, fmt, ...) msg(L_DEBUG | log_type_client, "Client %d: " fmt, client->id, ##__VA_ARGS__)
 
-struct tcp_modbus_header {
-	// All fields are big-endian
-	u16 transaction_id;
-	u16 protocol_id;		// Always 0
-	u16 length;
-} __attribute__((packed));
-
 static void client_msg(struct client *client, uint flags, const char *fmt, ...)
 {
 	va_list args;
@@ -40,17 +33,194 @@ static void client_msg(struct client *client, uint flags, const char *fmt, ...)
 
 static struct message *msg_new(struct client *client)
 {
-	struct message *m = xmalloc_zero(sizeof(*m));
-	m->box = client->box;
+	struct box *box = client->box;
+	struct message *m = clist_remove_head(&box->free_messages_qn);
+	if (m)
+		box->free_messages--;
+	else {
+		m = xmalloc(sizeof(*m));
+		box->cnt_msg_allocs++;
+	}
+
+	// Buffers are at the end and they are always written before being read
+	memset(m, 0, offsetof(struct message, request_size));
+	m->box = box;
 	m->client = client;
 	m->port = client->port;
+	m->arrival_time = get_time_us();
+	clist_init(&m->followers_qn);
 	return m;
 }
 
+bool msg_is_read(struct message *m)
+{
+	// Reading of registers has no side effects, so identical requests can share a reply
+	return (m->port->port_number && m->request[0] &&
+		(m->request[1] == MODBUS_FUNC_READ_HOLDING_REGISTERS || m->request[1] == MODBUS_FUNC_READ_INPUT_REGISTERS));
+}
+
+bool msg_is_write(struct message *m)
+{
+	if (!m->port->port_number)
+		return false;
+
+	switch (m->request[1]) {
+		case MODBUS_FUNC_WRITE_SINGLE_COIL:
+		case MODBUS_FUNC_WRITE_SINGLE_REGISTER:
+		case MODBUS_FUNC_WRITE_MULTIPLE_COILS:
+		case MODBUS_FUNC_WRITE_MULTIPLE_REGISTERS:
+		case MODBUS_FUNC_WRITE_FILE_RECORD:
+		case MODBUS_FUNC_MASK_WRITE_REGISTER:
+		case MODBUS_FUNC_READ_WRITE_MULTIPLE_REGISTERS:
+			return true;
+		default:
+			return false;
+	}
+}
+
+static bool msg_same_request(struct message *m, struct message *n)
+{
+	return (m->port == n->port &&
+		m->request_size == n->request_size &&
+		!memcmp(m->request, n->request, m->request_size));
+}
+
+static struct message *msg_find_leader(struct message *m)
+{
+	if (!msg_is_read(m))
+		return NULL;
+
+	// A leader may be ahead of a write to the same slave, so its reply might not reflect the write
+	struct port *port = m->port;
+	if (port->pending_writes[m->request[0]] || port->pending_writes[0])
+		return NULL;
+
+	CLIST_FOR_EACH(struct message *, n, m->port->ready_messages_qn)
+		if (msg_same_request(m, n))
+			return n;
+
+	CLIST_FOR_EACH(struct message *, n, m->box->busy_messages_qn)
+		if (msg_same_request(m, n) && !n->cancel)
+			return n;
+
+	return NULL;
+}
+
+static bool msg_is_retransmission(struct message *m)
+{
+	/*
+	 *  Some masters repeat a request with the same transaction ID after their
+	 *  own timeout. Others do not number their requests at all (the ID is
+	 *  always 0), so their identical requests are genuine and must be sent.
+	 */
+	if (!m->client_transaction_id)
+		return false;
+
+	struct client *client = m->client;
+	clist *lists[] = { &client->rx_messages_cn, &client->busy_messages_cn };
+
+	for (uint i=0; i < ARRAY_SIZE(lists); i++)
+		CLIST_FOR_EACH(cnode *, cn, *lists[i]) {
+			struct message *n = SKIP_BACK(struct message, client_node, cn);
+			if (n->client_transaction_id == m->client_transaction_id && msg_same_request(m, n))
+				return true;
+		}
+
+	return false;
+}
+
+struct message *msg_promote_follower(struct message *m)
+{
+	/*
+	 *  A message is not going to be sent, but other messages are waiting
+	 *  for its reply. The first of them whose client is still connected
+	 *  becomes the new leader and it is put at the head of its client's
+	 *  queue. The caller puts it to the port's ready queue. Orphaned
+	 *  followers are freed.
+	 */
+	struct message *f;
+	while ((f = clist_head(&m->followers_qn)) && !f->client) {
+		DBG("Dropping orphaned follower #%04x", f->client_transaction_id);
+		msg_free(f);
+	}
+	if (!f)
+		return NULL;
+
+	struct client *fc = f->client;
+	clist_remove(&f->queue_node);
+	f->leader = NULL;
+	clist_remove(&f->client_node);
+	if (clist_empty(&fc->rx_messages_cn))
+		clist_add_tail(&fc->port->ready_clients_qn, &fc->ready_node);
+	clist_add_head(&fc->rx_messages_cn, &f->client_node);
+
+	struct message *g;
+	while (g = clist_remove_head(&m->followers_qn)) {
+		g->leader = f;
+		clist_add_tail(&f->followers_qn, &g->queue_node);
+	}
+	return f;
+}
+
+static void msg_drop(struct message *m)
+{
+	// Drop a message which was not processed yet. If other messages are waiting
+	// for its reply, the first of them takes its place in the queue.
+	struct message *f = msg_promote_follower(m);
+	if (f)
+		clist_insert_after(&f->queue_node, &m->queue_node);
+
+	msg_free(m);
+}
+
+static void msg_recycle(struct message *m)
+{
+	// Return the message to the pool, unless the pool is full
+	struct box *box = m->box;
+	if (box->free_messages < box->message_pool_size) {
+		clist_add_head(&box->free_messages_qn, &m->queue_node);
+		box->free_messages++;
+	} else {
+		xfree(m);
+	}
+}
+
+// Pool size per port if MaxQueued is unlimited
+#define MSG_POOL_PER_PORT 16
+
+void msg_pool_prewarm(struct box *box, uint window)
+{
+	/*
+	 *  Unless configured explicitly, the pool covers full queues of one
+	 *  client per data port plus the window of the switch (for orphaned
+	 *  and internal messages). The window is known only after the switch
+	 *  is connected. The pool never shrinks.
+	 */
+	uint size = message_pool_size;
+	if (!size)
+		size = (NUM_PORTS - 1) * (max_queued_messages ? : MSG_POOL_PER_PORT) + window;
+
+	while (box->message_pool_size < size) {
+		struct message *m = xmalloc(sizeof(*m));
+		clist_add_tail(&box->free_messages_qn, &m->queue_node);
+		box->free_messages++;
+		box->message_pool_size++;
+	}
+}
+
+void msg_pool_init(struct box *box)
+{
+	clist_init(&box->free_messages_qn);
+	msg_pool_prewarm(box, 0);
+}
+
 void msg_free(struct message *m)
 {
+	if (m->poll)
+		poll_done(m);
+
 	struct client *client = m->client;
-	if (client) {
+	if (client && !client->internal) {
 		ASSERT(client->queued_messages);
 		if (client->queued_messages == max_queued_messages) {
 			CLIENT_DBG(client, "Uncorking");
@@ -59,44 +229,110 @@ void msg_free(struct message *m)
 		client->queued_messages--;
 	}
 
+	if (m->in_flight)
+		sched_msg_done(m);
+	if (m->pending_write)
+		m->port->pending_writes[m->request[0]]--;
+	timer_del(&m->reply_timer);
+
 	clist_remove(&m->queue_node);
 	clist_remove(&m->client_node);
 	if (m->ctrl)
 		xfree(m->ctrl);
-	xfree(m);
+	msg_recycle(m);
+}
+
+static void client_write_reply(struct client *client, struct message *m)
+{
+	struct main_rec_io *rio = &client->rio;
+	CLIENT_DBG(client, "Sending frame #%04x of %u bytes", m->client_transaction_id, m->reply_size);
+
+	struct tcp_modbus_header *h = (struct tcp_modbus_header *) m->reply_header;
+	put_u16_be(&h->transaction_id, m->client_transaction_id);
+	h->protocol_id = 0;
+	put_u16_be(&h->length, m->reply_size);
+	rec_io_write(rio, h, sizeof(*h) + m->reply_size);
+}
+
+static void msg_copy_reply(struct message *f, struct message *m)
+{
+	f->reply_time = m->reply_time;
+
+	if (f->request_size == m->request_size && !memcmp(f->request, m->request, m->request_size) ||
+	    (m->reply[1] & 0x80)) {
+		// Identical request or an exception
+		f->reply_size = m->reply_size;
+		memcpy(f->reply, m->reply, m->reply_size);
+		return;
+	}
+
+	// A part of a merged read (see merge.c)
+	uint offset = 2 * (get_u16_be(&f->request[2]) - get_u16_be(&m->request[2]));
+	uint len = 2 * get_u16_be(&f->request[4]);
+	if (m->reply_size < 3 + offset + len) {
+		f->reply[0] = f->request[0];
+		f->reply[1] = f->request[1] | 0x80;
+		f->reply[2] = MODBUS_ERR_GATEWAY_TARGET_DEVICE_FAILED;
+		f->reply_size = 3;
+		return;
+	}
+	f->reply[0] = m->reply[0];
+	f->reply[1] = m->reply[1];
+	f->reply[2] = len;
+	memcpy(f->reply + 3, m->reply + 3 + offset, len);
+	f->reply_size = 3 + len;
 }
 
 void msg_send_reply(struct message *m)
 {
+	if (m->reply_time)
+		cache_store(m);
+	if (m->reply_time && m->in_flight)
+		breaker_update(m);
+
+	// Followers get the same reply or its part (msg_free() removes them from the list)
+	struct message *f;
+	while (f = clist_head(&m->followers_qn)) {
+		msg_copy_reply(f, m);
+		msg_send_reply(f);
+	}
+
+	if (!m->client) {
+		DBG("Dropping reply to an orphaned message #%04x", m->client_transaction_id);
+		msg_free(m);
+		return;
+	}
+
 	if (m->request[0] == 0) {
 		CLIENT_DBG(m->client, "Not replying to broadcast #%04x", m->client_transaction_id);
 		msg_free(m);
 		return;
 	}
 
-	if (!m->client) {
-		DBG("Dropping reply to an orphaned message #%04x", m->client_transaction_id);
+	if (m->client->internal) {
 		msg_free(m);
 		return;
 	}
 
-	struct main_rec_io *rio = &m->client->rio;
-	CLIENT_DBG(m->client, "Sending frame #%04x of %u bytes", m->client_transaction_id, m->reply_size);
+	client_write_reply(m->client, m);
 
-	struct tcp_modbus_header h;
-	put_u16_be(&h.transaction_id, m->client_transaction_id);
-	h.protocol_id = 0;
-	put_u16_be(&h.length, m->reply_size);
-	rec_io_write(rio, &h, sizeof(h));
-
-	rec_io_write(rio, m->reply, m->reply_size);
+	if (m->reply_time) {
+		// Reply latency is accounted when the write buffer is flushed
+		struct client *client = m->client;
+		if (!client->unwritten_replies++)
+			client->unwritten_since = m->reply_time;
+		client->unwritten_reply_times += m->reply_time;
+	}
 
 	msg_free(m);
 }
 
 void msg_send_error_reply(struct message *m, enum modbus_error err)
 {
-	CLIENT_DBG(m->client, "Message #%04x failed with error %02x", m->client_transaction_id, err);
+	if (m->client)
+		CLIENT_DBG(m->client, "Message #%04x failed with error %02x", m->client_transaction_id, err);
+	else
+		DBG("Orphaned message #%04x failed with error %02x", m->client_transaction_id, err);
 	m->reply[0] = m->request[0];
 	m->reply[1] = m->request[1] | 0x80;
 	m->reply[2] = err;
@@ -104,6 +340,39 @@ void msg_send_error_reply(struct message *m, enum modbus_error err)
 	msg_send_reply(m);
 }
 
+void msg_fail_in_flight(struct message *m, enum modbus_error err)
+{
+	/*
+	 *  Fail a message whose reply did not arrive from USB in time, but keep
+	 *  it in flight as an orphan, because it still holds its USB message ID
+	 *  and a slot of the device's window (see usb_reply_timeout()). Followers
+	 *  fail immediately and a stand-in takes over the client's side.
+	 */
+	struct message *f;
+	while (f = clist_head(&m->followers_qn))
+		msg_send_error_reply(f, err);
+
+	struct client *client = m->client;
+	if (!client)
+		return;
+
+	struct message *e = msg_new(client);
+	e->client_transaction_id = m->client_transaction_id;
+	e->arrival_time = m->arrival_time;
+	e->poll = m->poll;
+	e->request_size = m->request_size;
+	memcpy(e->request, m->request, m->request_size);
+	clist_insert_after(&e->client_node, &m->client_node);
+	clist_add_tail(&m->box->busy_messages_qn, &e->queue_node);	// msg_free() removes it
+
+	clist_remove(&m->client_node);
+	clist_add_tail(&m->box->orphaned_messages_cn, &m->client_node);
+	m->client = NULL;
+	m->poll = NULL;
+
+	msg_send_error_reply(e, err);
+}
+
 static struct client *client_new(struct port *port, int id)
 {
 	struct client *c = xmalloc_zero(sizeof(*c));
@@ -115,26 +384,75 @@ static struct client *client_new(struct port *port, int id)
 	return c;
 }
 
+struct message *msg_new_internal(struct port *port)
+{
+	// Messages generated by the daemon itself belong to a per-port pseudo-client
+	if (!port->internal_client) {
+		port->internal_client = client_new(port, -1);
+		port->internal_client->internal = true;
+	}
+	return msg_new(port->internal_client);
+}
+
+void msg_take_ready(struct message *m)
+{
+	// The message leaves the ready queues and starts being processed
+	struct client *client = m->client;
+	clist_remove(&m->queue_node);
+	clist_remove(&m->client_node);
+	clist_add_tail(&client->busy_messages_cn, &m->client_node);
+	if (clist_empty(&client->rx_messages_cn))
+		clist_remove(&client->ready_node);
+}
+
+void msg_submit(struct message *m)
+{
+	struct client *client = m->client;
+
+	if (msg_is_write(m)) {
+		m->pending_write = true;
+		m->port->pending_writes[m->request[0]]++;
+	}
+
+	struct message *leader = client->internal ? NULL : msg_find_leader(m);
+	if (leader) {
+		// Attach to an identical request queued or in flight, the reply will be shared
+		CLIENT_DBG(client, "Frame #%04x coalesced with #%04x", m->client_transaction_id, leader->client_transaction_id);
+		m->leader = leader;
+		clist_add_tail(&leader->followers_qn, &m->queue_node);
+		clist_add_tail(&client->busy_messages_cn, &m->client_node);
+		m->port->cnt_coalesced++;
+	} else {
+		clist_add_tail(&client->port->ready_messages_qn, &m->queue_node);
+		if (clist_empty(&client->rx_messages_cn))
+			clist_add_tail(&client->port->ready_clients_qn, &client->ready_node);
+		clist_add_tail(&client->rx_messages_cn, &m->client_node);
+	}
+}
+
 static void client_free(struct client *client)
 {
 	rec_io_del(&client->rio);
 	close(client->rio.file.fd);
 
 	// Received, but unprocessed messages can be removed
-	CLIST_FOR_EACH(cnode *, mn, client->rx_messages_cn) {
+	if (!clist_empty(&client->rx_messages_cn))
+		clist_remove(&client->ready_node);
+	cnode *mn;
+	while (mn = clist_head(&client->rx_messages_cn)) {
 		struct message *m = SKIP_BACK(struct message, client_node, mn);
 		CLIENT_DBG(client, "Dropping message #%04x", m->client_transaction_id);
-		msg_free(m);
+		msg_drop(m);
 	}
 
 	// Messages which are being processed are turned into orphans
-	cnode *mn;
 	while (mn = clist_head(&client->busy_messages_cn)) {
 		struct message *m = SKIP_BACK(struct message, client_node, mn);
 		CLIENT_DBG(client, "Orphaning message #%04x", m->client_transaction_id);
 		clist_remove(mn);
 		clist_add_tail(&client->box->orphaned_messages_cn, mn);
 		m->client = NULL;
+		usb_cancel_message(m);
 	}
 
 	CLIENT_DBG(client, "Destroyed");
@@ -171,11 +489,27 @@ static uint sk_read_handler(struct main_rec_io *rio)
 
 	struct message *m = msg_new(client);
 	m->client_transaction_id = get_u16_be(&h->transaction_id);
-	m->request_size = 2 + len;
+	m->request_size = len;
 	memcpy(m->request, rio->read_buf + sizeof(struct tcp_modbus_header), len);
 
-	clist_add_tail(&client->port->ready_messages_qn, &m->queue_node);
-	clist_add_tail(&client->rx_messages_cn, &m->client_node);
+	if (msg_is_retransmission(m)) {
+		// The original is still queued or in flight, its reply will do for both
+		CLIENT_DBG(client, "Frame #%04x is a retransmission, folding it", m->client_transaction_id);
+		m->port->cnt_retransmissions++;
+		msg_recycle(m);
+		rec_io_set_timeout(rio, tcp_timeout * 1000);
+		return sizeof(struct tcp_modbus_header) + len;
+	}
+
+	if (cache_lookup(m)) {
+		CLIENT_DBG(client, "Frame #%04x answered from cache", m->client_transaction_id);
+		client_write_reply(client, m);
+		msg_recycle(m);
+		rec_io_set_timeout(rio, tcp_timeout * 1000);
+		return sizeof(struct tcp_modbus_header) + len;
+	}
+
+	msg_submit(m);
 
 	client->queued_messages++;
 	if (client->queued_messages == max_queued_messages) {
@@ -189,6 +523,21 @@ static uint sk_read_handler(struct main_rec_io *rio)
 	return sizeof(struct tcp_modbus_header) + len;
 }
 
+static void client_replies_written(struct client *client)
+{
+	if (!client->unwritten_replies)
+		return;
+
+	struct box *box = client->box;
+	u64 now = get_time_us();
+	box->cnt_reply_latency += client->unwritten_replies;
+	box->reply_latency_sum += client->unwritten_replies * now - client->unwritten_reply_times;
+	box->reply_latency_max = MAX(box->reply_latency_max, MIN(now - client->unwritten_since, ~0U));
+
+	client->unwritten_replies = 0;
+	client->unwritten_reply_times = 0;
+}
+
 static int sk_notify_handler(struct main_rec_io *rio, int status)
 {
 	struct client *client = rio->data;
@@ -206,6 +555,9 @@ static int sk_notify_handler(struct main_rec_io *rio, int status)
 		}
 		client_free(client);
 		return HOOK_IDLE;
+	} else if (status == RIO_EVENT_ALL_WRITTEN) {
+		client_replies_written(client);
+		return HOOK_RETRY;
 	} else if (status == RIO_EVENT_EOF) {
 		client_msg(client, L_INFO_R, "Closed connection");
 		client_free(client);
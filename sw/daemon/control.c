@@ -94,7 +94,9 @@ static bool check_input_register_addr(struct ctrl *c, uint addr)
 		c->need_get_port_status = true;
 		return true;
 	}
-	return false;
+	return (addr >= URS485_IREG_DAEMON_MIN && addr < URS485_IREG_DAEMON_MAX ||
+		addr >= URS485_IREG_BOX_MIN && addr < URS485_IREG_BOX_MAX ||
+		addr >= URS485_IREG_BREAKER_MIN && addr < URS485_IREG_BREAKER_MAX);
 }
 
 static uint get_input_register(struct ctrl *c, uint addr)
@@ -120,6 +122,42 @@ static uint get_input_register(struct ctrl *c, uint addr)
 			return u32_part(addr, port->cnt_mismatch_errors);
 		case URS485_IREG_CNT_TIMEOUTS ... URS485_IREG_CNT_TIMEOUTS_HI:
 			return u32_part(addr, port->cnt_timeouts);
+		case URS485_IREG_CNT_RETRIES ... URS485_IREG_CNT_RETRIES_HI:
+			return u32_part(addr, port->cnt_retries);
+		case URS485_IREG_CNT_COALESCED ... URS485_IREG_CNT_COALESCED_HI:
+			return u32_part(addr, port->cnt_coalesced);
+		case URS485_IREG_CNT_CACHE_HITS ... URS485_IREG_CNT_CACHE_HITS_HI:
+			return u32_part(addr, port->cnt_cache_hits);
+		case URS485_IREG_CNT_MERGED ... URS485_IREG_CNT_MERGED_HI:
+			return u32_part(addr, port->cnt_merged);
+		case URS485_IREG_CNT_EXPIRED ... URS485_IREG_CNT_EXPIRED_HI:
+			return u32_part(addr, port->cnt_expired);
+		case URS485_IREG_CNT_RETRANSMISSIONS ... URS485_IREG_CNT_RETRANSMISSIONS_HI:
+			return u32_part(addr, port->cnt_retransmissions);
+		case URS485_IREG_CNT_BREAKER_REJECTS ... URS485_IREG_CNT_BREAKER_REJECTS_HI:
+			return u32_part(addr, port->cnt_breaker_rejects);
+		case URS485_IREG_BOX_TX_WINDOW_STALLS ... URS485_IREG_BOX_TX_WINDOW_STALLS_HI:
+			return u32_part(addr, port->box->cnt_tx_window_stalls);
+		case URS485_IREG_BOX_TX_TRANSFER_STALLS ... URS485_IREG_BOX_TX_TRANSFER_STALLS_HI:
+			return u32_part(addr, port->box->cnt_tx_transfer_stalls);
+		case URS485_IREG_BOX_REPLY_LATENCY_COUNT ... URS485_IREG_BOX_REPLY_LATENCY_COUNT_HI:
+			return u32_part(addr, port->box->cnt_reply_latency);
+		case URS485_IREG_BOX_REPLY_LATENCY_SUM ... URS485_IREG_BOX_REPLY_LATENCY_SUM_HI:
+			return u32_part(addr, port->box->reply_latency_sum);
+		case URS485_IREG_BOX_REPLY_LATENCY_MAX ... URS485_IREG_BOX_REPLY_LATENCY_MAX_HI:
+			return u32_part(addr, port->box->reply_latency_max);
+		case URS485_IREG_BOX_CHANNEL0_BUSY_TIME ... URS485_IREG_BOX_CHANNEL0_BUSY_TIME_HI:
+			return u32_part(addr, sched_channel_busy_time(port->box, 0) / 1000);
+		case URS485_IREG_BOX_CHANNEL1_BUSY_TIME ... URS485_IREG_BOX_CHANNEL1_BUSY_TIME_HI:
+			return u32_part(addr, sched_channel_busy_time(port->box, 1) / 1000);
+		case URS485_IREG_BOX_REQUEST_LATENCY_MAX ... URS485_IREG_BOX_REQUEST_LATENCY_MAX_HI:
+			return u32_part(addr, port->box->request_latency_max);
+		case URS485_IREG_BOX_MSG_ALLOCS ... URS485_IREG_BOX_MSG_ALLOCS_HI:
+			return u32_part(addr, port->box->cnt_msg_allocs);
+		case URS485_IREG_BOX_LOST_REPLIES ... URS485_IREG_BOX_LOST_REPLIES_HI:
+			return u32_part(addr, port->box->cnt_lost_replies);
+		case URS485_IREG_BREAKER_MIN ... URS485_IREG_BREAKER_MAX - 1:
+			return breaker_state(port, addr - URS485_IREG_BREAKER_MIN);
 		default:
 			ASSERT(0);
 	}
@@ -143,6 +181,10 @@ static uint get_holding_register(struct ctrl *c, uint addr)
 			return port->powered;
 		case URS485_HREG_TIMEOUT:
 			return port->request_timeout;
+		case URS485_HREG_QUEUE_TTL:
+			return port->queue_ttl;
+		case URS485_HREG_RETRIES:
+			return port->retries;
 		case URS485_HREG_RESET_STATS:
 			return 0;
 		case URS485_HREG_DESCRIPTION_1 ... URS485_HREG_DESCRIPTION_4:
@@ -163,6 +205,10 @@ static bool check_holding_register_write(struct ctrl *c UNUSED, uint addr, uint
 			return (val <= 1);
 		case URS485_HREG_TIMEOUT:
 			return (val >= 1 && val <= 65535);
+		case URS485_HREG_QUEUE_TTL:
+			return (val <= 65535);
+		case URS485_HREG_RETRIES:
+			return (val <= 5);
 		case URS485_HREG_DESCRIPTION_1 ... URS485_HREG_DESCRIPTION_4:
 			for (uint i=0; i<2; i++) {
 				uint x = (val >> (8*i)) & 0xff;
@@ -177,6 +223,18 @@ static bool check_holding_register_write(struct ctrl *c UNUSED, uint addr, uint
 	}
 }
 
+bool control_check_port_params(struct port *port)
+{
+	// Settings loaded from persistent storage must obey the same limits as register writes
+	return (port->baud_rate % 100 == 0 &&
+		check_holding_register_write(NULL, URS485_HREG_BAUD_RATE, port->baud_rate / 100) &&
+		check_holding_register_write(NULL, URS485_HREG_PARITY, port->parity) &&
+		check_holding_register_write(NULL, URS485_HREG_POWERED, port->powered) &&
+		check_holding_register_write(NULL, URS485_HREG_TIMEOUT, port->request_timeout) &&
+		check_holding_register_write(NULL, URS485_HREG_QUEUE_TTL, port->queue_ttl) &&
+		check_holding_register_write(NULL, URS485_HREG_RETRIES, port->retries));
+}
+
 static void set_holding_register(struct ctrl *c, uint addr, uint val)
 {
 	struct port *port = c->for_port;
@@ -202,9 +260,25 @@ static void set_holding_register(struct ctrl *c, uint addr, uint val)
 			put_u16_be(&port->description[2*(addr - URS485_HREG_DESCRIPTION_1)], val);
 			persist_schedule_write(c->for_port->box);
 			break;
+		case URS485_HREG_RETRIES:
+			port->retries = val;
+			c->need_set_port_params = true;
+			break;
+		case URS485_HREG_QUEUE_TTL:
+			// Used only by the daemon
+			port->queue_ttl = val;
+			persist_schedule_write(c->for_port->box);
+			break;
 		case URS485_HREG_RESET_STATS:
-			if (val == 0xdead)
+			if (val == 0xdead) {
 				c->need_reset_port_stats = true;
+				port->cnt_coalesced = 0;
+				port->cnt_cache_hits = 0;
+				port->cnt_merged = 0;
+				port->cnt_expired = 0;
+				port->cnt_retransmissions = 0;
+				port->cnt_breaker_rejects = 0;
+			}
 			break;
 		default:
 			ASSERT(0);
@@ -480,8 +554,9 @@ static void func_encapsulated_interface_transport(struct ctrl *c)
 
 bool control_is_ready(struct box *box)
 {
-	// We currently process control messages one at a time
-	return clist_empty(&box->control_messages_qn);
+	// We currently process control messages one at a time.
+	// The control endpoint can be also busy cancelling messages.
+	return clist_empty(&box->control_messages_qn) && !usb_ctrl_is_busy(box);
 }
 
 static void control_process_message(struct ctrl *c)
@@ -38,7 +38,60 @@ enum urs485_input_register {
 	URS485_IREG_CNT_MISMATCH_ERRORS_HI,
 	URS485_IREG_CNT_TIMEOUTS = 16,			// Timeout when waiting for reply
 	URS485_IREG_CNT_TIMEOUTS_HI,
+	URS485_IREG_CNT_RETRIES = 18,			// Requests repeated because of a broken reply (not failures)
+	URS485_IREG_CNT_RETRIES_HI,
 	URS485_IREG_MAX,
+	/*
+	 *  Port statistics kept by the daemon. They do not need the switch
+	 *  to be connected.
+	 */
+	URS485_IREG_DAEMON_MIN = 0x100,
+	URS485_IREG_CNT_COALESCED = 0x100,		// Requests which shared a bus transaction with an identical one
+	URS485_IREG_CNT_COALESCED_HI,
+	URS485_IREG_CNT_CACHE_HITS = 0x102,		// Requests answered from the cache of register reads
+	URS485_IREG_CNT_CACHE_HITS_HI,
+	URS485_IREG_CNT_MERGED = 0x104,			// Requests merged into a read of another request
+	URS485_IREG_CNT_MERGED_HI,
+	URS485_IREG_CNT_EXPIRED = 0x106,		// Requests dropped after waiting for longer than the queue TTL
+	URS485_IREG_CNT_EXPIRED_HI,
+	URS485_IREG_CNT_RETRANSMISSIONS = 0x108,	// Requests repeated by the client while the original was pending
+	URS485_IREG_CNT_RETRANSMISSIONS_HI,
+	URS485_IREG_CNT_BREAKER_REJECTS = 0x10a,	// Requests failed because the slave's circuit breaker was open
+	URS485_IREG_CNT_BREAKER_REJECTS_HI,
+	URS485_IREG_DAEMON_MAX,
+	/*
+	 *  Statistics of the whole switch kept by the daemon.
+	 *  They read the same for all port addresses.
+	 */
+	URS485_IREG_BOX_MIN = 0x200,
+	URS485_IREG_BOX_TX_WINDOW_STALLS = 0x200,	// Scheduler had to wait for the device's window
+	URS485_IREG_BOX_TX_WINDOW_STALLS_HI,
+	URS485_IREG_BOX_TX_TRANSFER_STALLS = 0x202,	// Scheduler had to wait for a free bulk OUT transfer
+	URS485_IREG_BOX_TX_TRANSFER_STALLS_HI,
+	URS485_IREG_BOX_REPLY_LATENCY_COUNT = 0x204,	// Replies whose latency from USB arrival to TCP write was measured
+	URS485_IREG_BOX_REPLY_LATENCY_COUNT_HI,
+	URS485_IREG_BOX_REPLY_LATENCY_SUM = 0x206,	// Sum of these latencies [μs] (wraps around)
+	URS485_IREG_BOX_REPLY_LATENCY_SUM_HI,
+	URS485_IREG_BOX_REPLY_LATENCY_MAX = 0x208,	// Maximum of these latencies [μs]
+	URS485_IREG_BOX_REPLY_LATENCY_MAX_HI,
+	URS485_IREG_BOX_CHANNEL0_BUSY_TIME = 0x20a,	// Time with requests in flight on channel 0 (ports 5-8) [ms] (wraps around)
+	URS485_IREG_BOX_CHANNEL0_BUSY_TIME_HI,
+	URS485_IREG_BOX_CHANNEL1_BUSY_TIME = 0x20c,	// The same for channel 1 (ports 1-4)
+	URS485_IREG_BOX_CHANNEL1_BUSY_TIME_HI,
+	URS485_IREG_BOX_REQUEST_LATENCY_MAX = 0x20e,	// Maximum time from request arrival to reply from the switch [μs]
+	URS485_IREG_BOX_REQUEST_LATENCY_MAX_HI,
+	URS485_IREG_BOX_MSG_ALLOCS = 0x210,		// Messages allocated because the message pool was empty
+	URS485_IREG_BOX_MSG_ALLOCS_HI,
+	URS485_IREG_BOX_LOST_REPLIES = 0x212,		// Messages which timed out waiting for reply from the switch
+	URS485_IREG_BOX_LOST_REPLIES_HI,
+	URS485_IREG_BOX_MAX,
+	/*
+	 *  Circuit breakers of slaves on the port: register 0x300 + unit ID
+	 *  contains the number of consecutive failed transactions of the unit
+	 *  (up to 0x7fff), bit 15 is set when the breaker is open.
+	 */
+	URS485_IREG_BREAKER_MIN = 0x300,
+	URS485_IREG_BREAKER_MAX = 0x400,
 };
 
 /*
@@ -54,6 +107,8 @@ enum urs485_holding_register {
 	URS485_HREG_DESCRIPTION_2 = 6,
 	URS485_HREG_DESCRIPTION_3 = 7,
 	URS485_HREG_DESCRIPTION_4 = 8,
+	URS485_HREG_QUEUE_TTL = 9,			// Drop requests waiting in the daemon for longer [ms], 0=never
+	URS485_HREG_RETRIES = 10,			// Repeat requests with broken replies up to this many times (0 to 5)
 	URS485_HREG_CONFIG_MAX,
 	URS485_HREG_RESET_STATS = 0x1000,		// Write 0xdead to reset port statistics
 };
@@ -14,31 +14,75 @@
 #define DAEMON_VERSION "0.1"
 
 #define NUM_PORTS 9			// 0 is the control port, 1-8 data ports
+#define NUM_CHANNELS 2			// Each channel of the switch serves 4 ports
+#define PORTS_PER_CHANNEL 4
 #define PORT_DESCRIPTION_SIZE 8
 
+struct tcp_modbus_header {
+	// All fields are big-endian
+	u16 transaction_id;
+	u16 protocol_id;		// Always 0
+	u16 length;
+} __attribute__((packed));
+
+enum msg_cancel {			// Cancelling of orphaned messages in the switch
+	CANCEL_NONE,
+	CANCEL_PENDING,			// To be cancelled when the control endpoint is free
+	CANCEL_SENT,			// Cancel request sent (it fails if the switch is already transmitting)
+};
+
 struct message {
-	cnode queue_node;		// In either port->ready_messages or busy_messages
+	cnode queue_node;		// In either port->ready_messages, busy_messages, or leader->followers_qn
 	cnode client_node;		// In one of client's lists or orphan_list
 	struct box *box;
 	struct client *client;		// NULL for orphaned messages (client disconnected)
 	struct port *port;
 	u16 client_transaction_id;
 	u16 usb_message_id;
+	u16 usb_timeout;		// Reply timeout sent to the switch [ms], 0 if the port's one
+	u64 arrival_time;		// When the request arrived from the client [μs]
+	u64 sent_time;			// When the request was scheduled for sending over USB [μs]
+	u64 reply_time;			// When the reply arrived over USB [μs], 0 if not applicable
+	bool in_flight;			// Counted in port->in_flight and its channel
+	bool pending_write;		// Counted in port->pending_writes
+	u64 expected_duration;		// Of the transaction, as estimated when sent [μs]
+	struct message *leader;		// Request whose reply we share (identical or merged), or NULL
+	clist followers_qn;		// Requests sharing our reply
+	struct ctrl *ctrl;		// Context of processing a control message
+	struct poll *poll;		// Poll which generated this message (see poll.c)
+	struct main_timer reply_timer;	// Running while waiting for reply from USB
+	byte cancel;			// CANCEL_xxx
+	/*
+	 *  Buffers must be last, msg_new() does not clear them. Each buffer
+	 *  is preceded by room for the header it is sent with, so that it
+	 *  can be passed to USB or written to the socket without copying.
+	 */
 	uint request_size;
-	byte request[2 + MODBUS_MAX_DATA_SIZE];	// As in struct urs485_message, without CRC
 	uint reply_size;
+	byte request_header[URS485_MSGHDR_SIZE];	// struct urs485_message up to the frame (older protocols use its tail)
+	byte request[2 + MODBUS_MAX_DATA_SIZE];	// As in struct urs485_message, without CRC
+	byte reply_header[sizeof(struct tcp_modbus_header)];
 	byte reply[2 + MODBUS_MAX_DATA_SIZE];
-	struct ctrl *ctrl;		// Context of processing a control message
 };
 
 struct client {
 	int id;				// ID used in messages (we use socket FDs for that)
+	bool internal;			// Pseudo-client for messages generated by the daemon (no connection)
 	struct main_rec_io rio;		// TCP connection with the client
 	struct box *box;
 	struct port *port;
 	clist rx_messages_cn;		// Received from the client, waiting for processing
+	cnode ready_node;		// In port->ready_clients_qn iff rx_messages_cn is not empty
 	clist busy_messages_cn;		// Being processed
 	uint queued_messages;		// Number of messages in either queue
+	uint unwritten_replies;		// Replies from USB not yet written to the socket
+	u64 unwritten_since;		// reply_time of the oldest of them
+	u64 unwritten_reply_times;	// Sum of their reply_time's
+};
+
+struct breaker {			// Circuit breaker of a slave (see breaker.c)
+	uint failures;			// Consecutive failed transactions
+	u64 probe_at;			// When open: when to let the next request through [μs]
 };
 
 struct port {
@@ -47,12 +91,18 @@ struct port {
 	uint phys_number;
 	struct main_file listen_file;
 	clist ready_messages_qn;	// Ready to be sent over USB
+	clist ready_clients_qn;		// Clients with ready messages, in round-robin order
+	struct client *internal_client;	// Created on demand by msg_new_internal()
+	uint in_flight;			// Sent over USB, waiting for reply
+	uint avg_reply_time;		// Moving average of transaction time minus request wire time [μs], 0 if unknown
 
 	// Port settings (including host representation of urs485_port_params)
 	uint baud_rate;
 	uint parity;			// URS485_PARITY_xxx
 	uint powered;			// 0 or 1
 	uint request_timeout;		// in milliseconds
+	uint retries;			// Repeat requests with broken replies (in the switch)
+	uint queue_ttl;			// Drop requests queued for longer [ms], 0=never (used only by the daemon)
 	char description[PORT_DESCRIPTION_SIZE];
 
 	// Port status (host representation of urs485_port_status)
@@ -65,10 +115,41 @@ struct port {
 	uint cnt_crc_errors;
 	uint cnt_mismatch_errors;
 	uint cnt_timeouts;
+	uint cnt_retries;
+
+	// Port statistics kept by the daemon (see URS485_IREG_CNT_COALESCED etc.)
+	uint cnt_coalesced;
+	uint cnt_cache_hits;
+	uint cnt_merged;
+	uint cnt_expired;
+	uint cnt_retransmissions;
+	uint cnt_breaker_rejects;
+
+	// Cache of register reads (see cache.c)
+	clist cache_list;
+	uint cache_entries;
+	clist cache_free_list;		// Dropped entries, kept for reuse
+
+	// Circuit breakers indexed by unit ID
+	struct breaker breakers[256];
+
+	// Reply times of slaves indexed by unit ID (see timing.c), allocated on demand
+	struct slave_timing *timings[256];
+
+	// Writes queued or in flight indexed by unit ID (broadcasts are counted as unit 0)
+	u16 pending_writes[256];
 };
 
 #define SERIAL_SIZE 16			// Including traling 0
 
+struct channel {			// Channel of the switch (phys_number / PORTS_PER_CHANNEL)
+	uint in_flight;			// Requests sent over USB, waiting for reply
+	uint next_port;			// Round-robin pointer (index within the channel)
+	u64 busy_since;			// When in_flight became non-zero [μs]
+	u64 busy_time;			// Total time with in_flight > 0 [μs], not including the current interval
+	u64 expected_busy;		// Sum of expected durations of requests in flight [μs]
+};
+
 struct box {				// Switch device
 	cnode n;
 	struct switch_config *cf;
@@ -79,6 +160,21 @@ struct box {				// Switch device
 	struct main_hook sched_hook;
 	struct main_timer persist_timer;
 	struct usb_context *usb;
+	struct channel channels[NUM_CHANNELS];
+	uint sched_next_channel;	// Round-robin pointer
+	clist free_messages_qn;		// Pool of unused messages (see msg_new())
+	uint free_messages;
+	uint message_pool_size;		// Maximum of free_messages (see msg_pool_prewarm())
+
+	// Box-wide statistics (see URS485_IREG_BOX_xxx)
+	uint cnt_tx_window_stalls;
+	uint cnt_tx_transfer_stalls;
+	uint cnt_reply_latency;		// Number of replies measured
+	u64 reply_latency_sum;		// Time from reply arrival to TCP write [μs]
+	uint reply_latency_max;
+	uint request_latency_max;	// Time from request arrival to reply arrival over USB [μs]
+	uint cnt_msg_allocs;		// Messages allocated when the pool was empty
+	uint cnt_lost_replies;		// Messages which timed out waiting for reply from USB
 };
 
 extern clist box_list;
@@ -90,35 +186,85 @@ struct switch_config {
 	char *name;
 	char *serial;
 	uint tcp_port_base;
+	clist polls;			// of struct poll_config
+	clist slaves;			// of struct slave_config
+};
+
+struct slave_config {
+	cnode n;
+	uint port;			// 1-8
+	uint unit;
+	uint max_merged_registers;	// Overrides the global MaxMergedRegisters
+};
+
+struct poll_config {
+	cnode n;
+	uint port;			// 1-8
+	uint unit;
+	uint function;			// MODBUS_FUNC_READ_HOLDING_REGISTERS or MODBUS_FUNC_READ_INPUT_REGISTERS
+	uint start;
+	uint count;
+	uint interval;			// in milliseconds
 };
 
 extern uint tcp_timeout;
 extern uint log_connections;
 extern uint max_queued_messages;
 extern char *persistent_dir;
+extern int sched_mode;
+extern uint read_cache_ttl;
+extern uint max_merged_registers;
+extern uint message_pool_size;
+extern uint breaker_threshold;
+extern uint breaker_probe_interval;
+extern double adaptive_timeout_factor;
+extern uint adaptive_timeout_min;
+
+enum sched_mode {
+	SCHED_FAIR,			// Balance channels, ports, and clients
+	SCHED_EDF,			// Earliest deadline first (see sched_pick_edf())
+};
 extern struct clist switch_configs;
 
 extern uint log_type_client;
 extern uint log_type_usb;
 
 void persist_schedule_write(struct box *box);
+void sched_msg_done(struct message *m);
+u64 sched_channel_busy_time(struct box *box, uint channel);
+u64 sched_reply_timeout(struct message *m, uint window);
+u64 get_time_us(void);
 
 /* client.c */
 
 void net_init_port(struct port *port);
 
+void msg_pool_init(struct box *box);
+void msg_pool_prewarm(struct box *box, uint window);
 void msg_free(struct message *m);
 void msg_send_reply(struct message *m);
 void msg_send_error_reply(struct message *m, enum modbus_error err);
+void msg_fail_in_flight(struct message *m, enum modbus_error err);
+bool msg_is_read(struct message *m);
+bool msg_is_write(struct message *m);
+struct message *msg_new_internal(struct port *port);
+void msg_submit(struct message *m);
+void msg_take_ready(struct message *m);
+struct message *msg_promote_follower(struct message *m);
 
 /* usb.c */
 
 void usb_init(void);
 bool usb_is_ready(struct box *box);
+void usb_note_stall(struct box *box);
 void usb_submit_message(struct message *m);
+void usb_flush(struct box *box);
 bool usb_submit_get_port_status(struct port *port);
 bool usb_submit_set_port_params(struct port *port);
 bool usb_submit_reset_port_stats(struct port *port);
+bool usb_ctrl_is_busy(struct box *box);
+void usb_cancel_message(struct message *m);
+bool usb_submit_cancel(struct box *box);
 char *usb_get_revision(struct box *box);
 char *usb_get_serial_number(struct box *box);
 
@@ -127,3 +273,47 @@ char *usb_get_serial_number(struct box *box);
 bool control_is_ready(struct box *box);
 void control_submit_message(struct message *m);
 void control_usb_done(struct box *box);
+bool control_check_port_params(struct port *port);
+
+/* cache.c */
+
+bool cache_lookup(struct message *m);
+void cache_store(struct message *m);
+
+/* merge.c */
+
+struct message *merge_reads(struct message *m);
+
+/* poll.c */
+
+void poll_init(struct box *box);
+void poll_done(struct message *m);
+uint poll_cache_ttl(struct poll *p);
+
+/* breaker.c */
+
+bool breaker_allows(struct message *m);
+void breaker_update(struct message *m);
+uint breaker_state(struct port *port, uint unit);
+
+/* ids.c */
+
+#define ID_SLOTS 256
+#define ID_BUSY(t) (ID_SLOTS - (t)->free_count)
+
+struct id_table {			// Messages in flight over USB indexed by their ID
+	struct message *msgs[ID_SLOTS];
+	u16 last[ID_SLOTS];		// Last ID assigned to each slot
+	byte free[ID_SLOTS];		// Ring of free slots
+	uint free_head, free_count;
+};
+
+void id_table_init(struct id_table *t);
+void id_alloc(struct id_table *t, struct message *m);
+struct message *id_find(struct id_table *t, u16 id);
+void id_free(struct id_table *t, struct message *m);
+
+/* timing.c */
+
+uint timing_timeout(struct message *m);
+void timing_update(struct message *m, uint reply_time);
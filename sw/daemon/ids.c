@@ -0,0 +1,54 @@
+/*
+ *	USB-RS485 Switch Daemon -- USB Message IDs
+ *
+ *	(c) 2022--2023 Martin Mares <mj@ucw.cz>
+ */
+
+#include "daemon.h"
+
+/*
+ *  In-flight messages are indexed by the low 8 bits of their ID.
+ *  The upper bits count re-uses of the same slot, so that a late reply
+ *  to a message we already forgot about is not mistaken for a reply
+ *  to a newer message. Free slots are re-used in FIFO order.
+ */
+
+void id_table_init(struct id_table *t)
+{
+	for (uint i=0; i < ID_SLOTS; i++) {
+		t->msgs[i] = NULL;
+		t->free[i] = i;
+	}
+	t->free_head = 0;
+	t->free_count = ID_SLOTS;
+}
+
+void id_alloc(struct id_table *t, struct message *m)
+{
+	// The window is much smaller than the table
+	ASSERT(t->free_count);
+	uint slot = t->free[t->free_head];
+	t->free_head = (t->free_head + 1) % ID_SLOTS;
+	t->free_count--;
+
+	u16 id = (t->last[slot] + ID_SLOTS) & ~(ID_SLOTS - 1);
+	id |= slot;
+	t->last[slot] = id;
+	t->msgs[slot] = m;
+	m->usb_message_id = id;
+}
+
+struct message *id_find(struct id_table *t, u16 id)
+{
+	struct message *m = t->msgs[id % ID_SLOTS];
+	return (m && m->usb_message_id == id) ? m : NULL;
+}
+
+void id_free(struct id_table *t, struct message *m)
+{
+	uint slot = m->usb_message_id % ID_SLOTS;
+	ASSERT(t->msgs[slot] == m);
+	t->msgs[slot] = NULL;
+	t->free[(t->free_head + t->free_count) % ID_SLOTS] = slot;
+	t->free_count++;
+}
@@ -0,0 +1,99 @@
+/*
+ *	USB-RS485 Switch Daemon -- Merging of Register Reads
+ *
+ *	(c) 2022--2023 Martin Mares <mj@ucw.cz>
+ */
+
+#include "daemon.h"
+
+#include <ucw/unaligned.h>
+
+/*
+ *  Reads of overlapping or adjacent register ranges of the same slave
+ *  waiting on the same port can be merged to a single bus transaction.
+ *  On slow buses, this saves the per-transaction overhead (inter-frame gaps,
+ *  turnaround, CRC). The merged request is sent by the port's internal
+ *  pseudo-client and the original requests are attached to it as followers,
+ *  which get their part of the reply in msg_send_reply().
+ */
+
+#define MODBUS_MAX_READ_REGISTERS 125
+
+static uint merge_limit(struct port *port, uint unit)
+{
+	CLIST_FOR_EACH(struct slave_config *, sc, port->box->cf->slaves)
+		if (sc->port == port->port_number && sc->unit == unit)
+			return sc->max_merged_registers;
+	return max_merged_registers;
+}
+
+static bool merge_can_read(struct message *m)
+{
+	return (msg_is_read(m) && m->request_size == 6 && !m->client->internal);
+}
+
+static bool merge_is_next(struct message *m)
+{
+	// A client's requests must not overtake each other (e.g., a read its preceding write)
+	return (clist_head(&m->client->rx_messages_cn) == &m->client_node);
+}
+
+struct message *merge_reads(struct message *m)
+{
+	// Called by the scheduler for a message taken from the ready queue
+	if (!merge_can_read(m))
+		return m;
+
+	struct port *port = m->port;
+	uint unit = m->request[0];
+	uint limit = MIN(merge_limit(port, unit), MODBUS_MAX_READ_REGISTERS);
+	uint lo = get_u16_be(&m->request[2]);
+	uint hi = lo + get_u16_be(&m->request[4]);
+	if (hi - lo >= limit)
+		return m;
+
+	// Find requests which extend the range, until nothing changes
+	struct message *merged[MODBUS_MAX_READ_REGISTERS];
+	uint num_merged = 0;
+	bool changed;
+	do {
+		changed = false;
+		struct message *n, *tmp;
+		CLIST_WALK_DELSAFE(n, port->ready_messages_qn, tmp) {
+			if (!merge_can_read(n) || !merge_is_next(n) || n->request[0] != unit || n->request[1] != m->request[1])
+				continue;
+			uint nlo = get_u16_be(&n->request[2]);
+			uint nhi = nlo + get_u16_be(&n->request[4]);
+			if (nhi < lo || nlo > hi || MAX(hi, nhi) - MIN(lo, nlo) > limit || num_merged >= ARRAY_SIZE(merged))
+				continue;
+			msg_take_ready(n);
+			merged[num_merged++] = n;
+			lo = MIN(lo, nlo);
+			hi = MAX(hi, nhi);
+			changed = true;
+		}
+	} while (changed);
+
+	if (!num_merged)
+		return m;
+
+	struct message *l = msg_new_internal(port);
+	l->request[0] = unit;
+	l->request[1] = m->request[1];
+	put_u16_be(&l->request[2], lo);
+	put_u16_be(&l->request[4], hi - lo);
+	l->request_size = 6;
+	l->arrival_time = m->arrival_time;
+	clist_add_tail(&l->client->busy_messages_cn, &l->client_node);
+	DBG("Merged %u reads from unit %u on port %u to registers %u-%u", num_merged + 1, unit, port->port_number, lo, hi - 1);
+
+	m->leader = l;
+	clist_add_tail(&l->followers_qn, &m->queue_node);
+	for (uint i=0; i < num_merged; i++) {
+		merged[i]->leader = l;
+		clist_add_tail(&l->followers_qn, &merged[i]->queue_node);
+	}
+	port->cnt_merged += num_merged;
+
+	return l;
+}
@@ -0,0 +1,68 @@
+/*
+ *	USB-RS485 Switch Daemon -- Polling of Registers
+ *
+ *	(c) 2022--2023 Martin Mares <mj@ucw.cz>
+ */
+
+#include "daemon.h"
+
+#include <ucw/unaligned.h>
+
+/*
+ *  The daemon can poll configured register ranges periodically on its own.
+ *  Replies are stored in the read cache (see cache.c), so client reads of
+ *  the same range are answered from the latest sample. Poll requests are
+ *  queued on the port like requests of any other client.
+ */
+
+struct poll {
+	struct poll_config *cf;
+	struct port *port;
+	struct main_timer timer;
+	bool busy;			// Request in progress
+};
+
+static void poll_handler(struct main_timer *tm)
+{
+	struct poll *p = tm->data;
+	timer_add_rel(tm, p->cf->interval);
+
+	if (p->busy) {
+		// The previous request has not finished yet (e.g., slave timed out)
+		DBG("Poll of port %u unit %u still busy", p->port->port_number, p->cf->unit);
+		return;
+	}
+
+	struct message *m = msg_new_internal(p->port);
+	m->poll = p;
+	m->request[0] = p->cf->unit;
+	m->request[1] = p->cf->function;
+	put_u16_be(&m->request[2], p->cf->start);
+	put_u16_be(&m->request[4], p->cf->count);
+	m->request_size = 6;
+	msg_submit(m);
+	p->busy = true;
+}
+
+void poll_done(struct message *m)
+{
+	m->poll->busy = false;
+}
+
+uint poll_cache_ttl(struct poll *p)
+{
+	// Samples stay valid even if one poll is missed
+	return 2 * p->cf->interval;
+}
+
+void poll_init(struct box *box)
+{
+	CLIST_FOR_EACH(struct poll_config *, pc, box->cf->polls) {
+		struct poll *p = xmalloc_zero(sizeof(*p));
+		p->cf = pc;
+		p->port = &box->ports[pc->port];
+		p->timer.handler = poll_handler;
+		p->timer.data = p;
+		timer_add_rel(&p->timer, pc->interval);
+	}
+}
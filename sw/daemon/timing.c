@@ -0,0 +1,88 @@
+/*
+ *	USB-RS485 Switch Daemon -- Adaptive Reply Timeouts
+ *
+ *	(c) 2022--2023 Martin Mares <mj@ucw.cz>
+ */
+
+#include "daemon.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ *  The port's request timeout must cover the slowest slave on the port.
+ *  Switches speaking protocol 0x0300 report how long each slave took to
+ *  start replying and accept a timeout for each request. We keep recent
+ *  reply times of each slave and ask the switch to wait for their 99th
+ *  percentile times AdaptiveTimeoutFactor (but at least AdaptiveTimeoutMin
+ *  and at most the port's timeout), so that a dead slave costs milliseconds
+ *  instead of seconds.
+ */
+
+#define TIMING_SAMPLES 128		// Recent samples kept per slave
+#define TIMING_MIN_SAMPLES 32		// Do not adapt until we have this many samples
+#define TIMING_RECALC 16		// Recalculate the timeout after this many new samples
+
+struct slave_timing {
+	u16 samples[TIMING_SAMPLES];	// Ring buffer of reply times [ms]
+	uint num_samples;
+	uint next;
+	uint new_samples;		// Since the last recalculation
+	uint timeout;			// [ms], 0 if not known yet
+};
+
+static int timing_cmp(const void *a, const void *b)
+{
+	return *(const u16 *) a - *(const u16 *) b;
+}
+
+static void timing_recalc(struct slave_timing *t)
+{
+	u16 sorted[TIMING_SAMPLES];
+	memcpy(sorted, t->samples, t->num_samples * sizeof(u16));
+	qsort(sorted, t->num_samples, sizeof(u16), timing_cmp);
+
+	uint p99 = sorted[(t->num_samples * 99 + 99) / 100 - 1];
+	t->timeout = MAX((uint) (p99 * adaptive_timeout_factor), adaptive_timeout_min);
+	t->new_samples = 0;
+}
+
+static void timing_add(struct port *port, uint unit, uint sample)
+{
+	struct slave_timing *t = port->timings[unit];
+	if (!t)
+		t = port->timings[unit] = xmalloc_zero(sizeof(*t));
+
+	t->samples[t->next] = MIN(sample, 0xffff);
+	t->next = (t->next + 1) % TIMING_SAMPLES;
+	if (t->num_samples < TIMING_SAMPLES)
+		t->num_samples++;
+
+	if (t->num_samples >= TIMING_MIN_SAMPLES && ++t->new_samples >= TIMING_RECALC)
+		timing_recalc(t);
+}
+
+uint timing_timeout(struct message *m)
+{
+	// Timeout to send with the request [ms], 0 for the timeout of the port
+	uint unit = m->request[0];
+	struct slave_timing *t = m->port->timings[unit];
+	if (adaptive_timeout_factor <= 0 || !unit || !t || !t->timeout)
+		return 0;
+	return (t->timeout < m->port->request_timeout) ? t->timeout : 0;
+}
+
+void timing_update(struct message *m, uint reply_time)
+{
+	// Called for replies from switches which report reply times
+	uint unit = m->request[0];
+	if (adaptive_timeout_factor <= 0 || !unit)
+		return;
+
+	if (reply_time) {
+		timing_add(m->port, unit, reply_time);
+	} else if (m->usb_timeout && m->reply_size >= 3 && m->reply[2] == MODBUS_ERR_GATEWAY_TARGET_DEVICE_FAILED) {
+		// Failed with a shortened timeout: maybe the slave became slower, so let the timeout grow
+		timing_add(m->port, unit, 2 * m->usb_timeout);
+	}
+}
@@ -7,6 +7,7 @@
 #include "daemon.h"
 
 #include <fcntl.h>
+#include <time.h>
 #include <ucw/conf.h>
 #include <ucw/fastbuf.h>
 #include <ucw/log.h>
@@ -23,6 +24,20 @@ uint tcp_timeout = 60;
 uint log_connections;
 uint max_queued_messages;
 char *persistent_dir;
+int sched_mode;
+uint read_cache_ttl;
+uint max_merged_registers;
+uint message_pool_size;
+uint breaker_threshold;
+uint breaker_probe_interval = 10000;
+double adaptive_timeout_factor;
+uint adaptive_timeout_min = 20;
+
+static const char * const sched_mode_names[] = {
+	[SCHED_FAIR] = "fair",
+	[SCHED_EDF] = "edf",
+	NULL
+};
 
 static char *switch_commit(void *s_)
 {
@@ -34,6 +49,57 @@ static char *switch_commit(void *s_)
 	return NULL;
 }
 
+static char *poll_commit(void *p_)
+{
+	struct poll_config *p = p_;
+	if (p->port < 1 || p->port >= NUM_PORTS)
+		return "Poll: Port must be between 1 and 8";
+	if (p->unit < 1 || p->unit > 247)
+		return "Poll: Unit must be between 1 and 247";
+	if (p->function != MODBUS_FUNC_READ_HOLDING_REGISTERS && p->function != MODBUS_FUNC_READ_INPUT_REGISTERS)
+		return "Poll: Function must be 3 (read holding registers) or 4 (read input registers)";
+	if (p->start > 0xffff || p->count < 1 || p->count > 125)
+		return "Poll: Invalid register range";
+	if (!p->interval)
+		return "Poll: Interval must be positive";
+	return NULL;
+}
+
+static struct cf_section poll_config = {
+	CF_TYPE(struct poll_config),
+	CF_COMMIT(poll_commit),
+	CF_ITEMS {
+		CF_UINT("Port", PTR_TO(struct poll_config, port)),
+		CF_UINT("Unit", PTR_TO(struct poll_config, unit)),
+		CF_UINT("Function", PTR_TO(struct poll_config, function)),
+		CF_UINT("Start", PTR_TO(struct poll_config, start)),
+		CF_UINT("Count", PTR_TO(struct poll_config, count)),
+		CF_UINT("Interval", PTR_TO(struct poll_config, interval)),
+		CF_END
+	}
+};
+
+static char *slave_commit(void *s_)
+{
+	struct slave_config *s = s_;
+	if (s->port < 1 || s->port >= NUM_PORTS)
+		return "Slave: Port must be between 1 and 8";
+	if (s->unit < 1 || s->unit > 247)
+		return "Slave: Unit must be between 1 and 247";
+	return NULL;
+}
+
+static struct cf_section slave_config = {
+	CF_TYPE(struct slave_config),
+	CF_COMMIT(slave_commit),
+	CF_ITEMS {
+		CF_UINT("Port", PTR_TO(struct slave_config, port)),
+		CF_UINT("Unit", PTR_TO(struct slave_config, unit)),
+		CF_UINT("MaxMergedRegisters", PTR_TO(struct slave_config, max_merged_registers)),
+		CF_END
+	}
+};
+
 static struct cf_section switch_config = {
 	CF_TYPE(struct switch_config),
 	CF_COMMIT(switch_commit),
@@ -41,6 +107,8 @@ static struct cf_section switch_config = {
 		CF_STRING("Name", PTR_TO(struct switch_config, name)),
 		CF_STRING("Serial", PTR_TO(struct switch_config, serial)),
 		CF_UINT("TCPPortBase", PTR_TO(struct switch_config, tcp_port_base)),
+		CF_LIST("Poll", PTR_TO(struct switch_config, polls), &poll_config),
+		CF_LIST("Slave", PTR_TO(struct switch_config, slaves), &slave_config),
 		CF_END
 	}
 };
@@ -66,6 +134,14 @@ static struct cf_section daemon_config = {
 		CF_UINT("LogConnections", &log_connections),
 		CF_UINT("MaxQueued", &max_queued_messages),
 		CF_STRING("PersistentDir", &persistent_dir),
+		CF_LOOKUP("Scheduler", &sched_mode, sched_mode_names),
+		CF_UINT("ReadCacheTTL", &read_cache_ttl),
+		CF_UINT("MaxMergedRegisters", &max_merged_registers),
+		CF_UINT("MessagePool", &message_pool_size),
+		CF_UINT("BreakerThreshold", &breaker_threshold),
+		CF_UINT("BreakerProbeInterval", &breaker_probe_interval),
+		CF_DOUBLE("AdaptiveTimeoutFactor", &adaptive_timeout_factor),
+		CF_UINT("AdaptiveTimeoutMin", &adaptive_timeout_min),
 		CF_END
 	}
 };
@@ -84,26 +160,250 @@ static const struct opt_section options = {
 
 /*** Scheduler ***/
 
-static struct message *sched_next_msg(struct box *box)
+static struct message *sched_take_msg(struct port *port)
 {
-	// Round-robin on ports. Replace by a better scheduler one day.
-	static int robin = 1;
-
-	for (int i=0; i<NUM_PORTS-1; i++) {
-		robin = robin + 1;
-		if (robin == NUM_PORTS)
-			robin = 1;
-		struct port *port = &box->ports[robin];
-		struct message *m;
-		if (m = clist_remove_head(&port->ready_messages_qn)) {
-			clist_add_tail(&box->busy_messages_qn, &m->queue_node);
-			clist_remove(&m->client_node);
-			clist_add_tail(&m->client->busy_messages_cn, &m->client_node);
-			return m;
+	// Clients of the same port take turns, so that a client which pipelines
+	// many requests does not delay the others.
+	cnode *cn = clist_head(&port->ready_clients_qn);
+	if (!cn)
+		return NULL;
+	clist_remove(cn);
+	clist_add_tail(&port->ready_clients_qn, cn);
+	struct client *client = SKIP_BACK(struct client, ready_node, cn);
+
+	struct message *m = SKIP_BACK(struct message, client_node, clist_head(&client->rx_messages_cn));
+	msg_take_ready(m);
+	return m;
+}
+
+static struct port *sched_channel_port(struct box *box, uint channel, uint i)
+{
+	uint phys = channel * PORTS_PER_CHANNEL + i;
+	return &box->ports[NUM_PORTS - 1 - phys];
+}
+
+static int sched_pick_port(struct box *box, uint channel)
+{
+	// Among ports with ready messages, pick the one with the least requests in flight
+	struct channel *ch = &box->channels[channel];
+	int best = -1;
+	uint best_in_flight = ~0U;
+
+	for (uint i=0; i<PORTS_PER_CHANNEL; i++) {
+		uint p = (ch->next_port + i) % PORTS_PER_CHANNEL;
+		struct port *port = sched_channel_port(box, channel, p);
+		if (!clist_empty(&port->ready_messages_qn) && port->in_flight < best_in_flight) {
+			best = p;
+			best_in_flight = port->in_flight;
 		}
 	}
 
-	return NULL;
+	return best;
+}
+
+static bool sched_pick_fair(struct box *box, int *best_channel, int *best_port)
+{
+	/*
+	 *  Ports sharing a channel are served by a single USART of the switch,
+	 *  so we try to keep in-flight requests balanced between the channels
+	 *  first and then between the ports of the channel. Ties are broken
+	 *  by round-robin.
+	 */
+	uint best_in_flight = ~0U;
+
+	for (uint i=0; i<NUM_CHANNELS; i++) {
+		uint c = (box->sched_next_channel + i) % NUM_CHANNELS;
+		if (box->channels[c].in_flight >= best_in_flight)
+			continue;
+		int p = sched_pick_port(box, c);
+		if (p >= 0) {
+			*best_channel = c;
+			*best_port = p;
+			best_in_flight = box->channels[c].in_flight;
+		}
+	}
+
+	return (*best_channel >= 0);
+}
+
+static u64 sched_wire_time(struct message *m)
+{
+	// Time needed to transmit the request (1 character = 11 bits, including CRC)
+	return (u64) (m->request_size + 2) * 11 * 1000000 / m->port->baud_rate;
+}
+
+static u64 sched_expected_duration(struct message *m)
+{
+	// Expected duration of the transaction, as observed on the port if possible
+	struct port *port = m->port;
+	u64 wire = sched_wire_time(m);
+	return wire + (port->avg_reply_time ? port->avg_reply_time : wire);
+}
+
+static u64 sched_deadline(struct message *m)
+{
+	// Requests already sent to the same channel will be served first
+	struct channel *ch = &m->box->channels[m->port->phys_number / PORTS_PER_CHANNEL];
+	return m->arrival_time + ch->expected_busy + sched_expected_duration(m);
+}
+
+static bool sched_pick_edf(struct box *box, int *best_channel, int *best_port)
+{
+	/*
+	 *  Earliest deadline first, where the deadline is the arrival time plus
+	 *  the expected duration of the transaction, including the requests
+	 *  in flight on the same channel. Short requests on fast ports therefore
+	 *  overtake slow ones, but cannot starve them, and requests for a busy
+	 *  channel do not occupy the window of the switch while requests for
+	 *  the other channel wait. Of requests with equal deadlines, we prefer
+	 *  the channel with less requests in flight.
+	 */
+	u64 best_deadline = ~0ULL;
+
+	for (uint c=0; c<NUM_CHANNELS; c++)
+		for (uint p=0; p<PORTS_PER_CHANNEL; p++) {
+			struct port *port = sched_channel_port(box, c, p);
+			cnode *cn = clist_head(&port->ready_clients_qn);
+			if (!cn)
+				continue;
+			struct client *client = SKIP_BACK(struct client, ready_node, cn);
+			struct message *m = SKIP_BACK(struct message, client_node, clist_head(&client->rx_messages_cn));
+			u64 deadline = sched_deadline(m);
+			if (deadline < best_deadline ||
+			    deadline == best_deadline && box->channels[c].in_flight < box->channels[*best_channel].in_flight) {
+				*best_channel = c;
+				*best_port = p;
+				best_deadline = deadline;
+			}
+		}
+
+	return (*best_channel >= 0);
+}
+
+static bool sched_drop(struct message *m)
+{
+	struct port *port = m->port;
+	enum modbus_error err;
+
+	if (port->queue_ttl && get_time_us() - m->arrival_time > (u64) port->queue_ttl * 1000) {
+		// Clients have probably given up on requests which waited longer than the queue TTL
+		DBG("Frame #%04x of client %d expired in queue", m->client_transaction_id, m->client->id);
+		port->cnt_expired++;
+		err = MODBUS_ERR_GATEWAY_PATH_UNAVAILABLE;
+
+		// Coalesced requests might have arrived much later, so the first of them takes over
+		struct message *f = msg_promote_follower(m);
+		if (f)
+			clist_add_head(&port->ready_messages_qn, &f->queue_node);
+	} else if (!breaker_allows(m)) {
+		DBG("Frame #%04x of client %d rejected by circuit breaker", m->client_transaction_id, m->client->id);
+		err = MODBUS_ERR_GATEWAY_TARGET_DEVICE_FAILED;
+	} else {
+		return false;
+	}
+
+	clist_add_tail(&port->box->busy_messages_qn, &m->queue_node);	// msg_free() removes it
+	msg_send_error_reply(m, err);
+	return true;
+}
+
+static struct message *sched_next_msg(struct box *box)
+{
+	int best_channel, best_port;
+	struct port *port;
+	struct message *m;
+
+	do {
+		best_channel = best_port = -1;
+		if (!(sched_mode == SCHED_EDF ? sched_pick_edf : sched_pick_fair)(box, &best_channel, &best_port))
+			return NULL;
+
+		port = sched_channel_port(box, best_channel, best_port);
+		box->sched_next_channel = (best_channel + 1) % NUM_CHANNELS;
+		box->channels[best_channel].next_port = (best_port + 1) % PORTS_PER_CHANNEL;
+		m = sched_take_msg(port);
+	} while (sched_drop(m));
+
+	struct channel *ch = &box->channels[best_channel];
+	m = merge_reads(m);
+	clist_add_tail(&box->busy_messages_qn, &m->queue_node);
+
+	m->in_flight = true;
+	m->sent_time = get_time_us();
+	m->expected_duration = sched_expected_duration(m);
+	port->in_flight++;
+	if (!ch->in_flight++)
+		ch->busy_since = get_time_us();
+	ch->expected_busy += m->expected_duration;
+
+	return m;
+}
+
+void sched_msg_done(struct message *m)
+{
+	struct port *port = m->port;
+	struct channel *ch = &port->box->channels[port->phys_number / PORTS_PER_CHANNEL];
+
+	ASSERT(m->in_flight && port->in_flight && ch->in_flight);
+	m->in_flight = false;
+	port->in_flight--;
+	if (!--ch->in_flight)
+		ch->busy_time += get_time_us() - ch->busy_since;
+	ch->expected_busy -= m->expected_duration;
+
+	if (m->reply_time && !m->cancel) {
+		// Learn how long the device takes to reply on this port
+		s64 sample = m->reply_time - m->sent_time - sched_wire_time(m);
+		sample = MAX(sample, 1);
+		if (port->avg_reply_time)
+			port->avg_reply_time += (sample - (s64) port->avg_reply_time) / 8;
+		else
+			port->avg_reply_time = sample;
+
+		struct box *box = port->box;
+		box->request_latency_max = MAX(box->request_latency_max, MIN(m->reply_time - m->arrival_time, ~0U));
+	}
+}
+
+// Allowance for latency of USB and processing in the switch
+#define SCHED_REPLY_MARGIN 1000000
+
+u64 sched_reply_timeout(struct message *m, uint window)
+{
+	/*
+	 *  How long to wait for a reply to a message just sent [μs]. The switch
+	 *  processes requests of a channel one by one, but it takes turns between
+	 *  ports, so requests sent later can be served first. In the worst case,
+	 *  the whole window of the device is ahead of us and each request takes
+	 *  the timeout of its port plus transmission of a maximum request and reply.
+	 */
+	struct port *port = m->port;
+	uint c = port->phys_number / PORTS_PER_CHANNEL;
+	u64 per_request = 0;
+	for (uint p=0; p<PORTS_PER_CHANNEL; p++) {
+		struct port *q = sched_channel_port(port->box, c, p);
+		u64 t = (u64) q->request_timeout * 1000 + (u64) 2 * (4 + MODBUS_MAX_DATA_SIZE) * 11 * 1000000 / q->baud_rate;
+		t *= q->retries + 1;
+		per_request = MAX(per_request, t);
+	}
+	return window * per_request + SCHED_REPLY_MARGIN;
+}
+
+u64 sched_channel_busy_time(struct box *box, uint channel)
+{
+	struct channel *ch = &box->channels[channel];
+	u64 t = ch->busy_time;
+	if (ch->in_flight)
+		t += get_time_us() - ch->busy_since;
+	return t;
+}
+
+static bool sched_has_ready(struct box *box)
+{
+	for (int i=1; i<NUM_PORTS; i++)
+		if (!clist_empty(&box->ports[i].ready_messages_qn))
+			return true;
+	return false;
 }
 
 static int sched_handler(struct main_hook *hook)
@@ -111,9 +411,12 @@ static int sched_handler(struct main_hook *hook)
 	struct box *box = hook->data;
 	struct message *m;
 
+	// Cancel orphaned messages, which shares the control endpoint with control messages
+	if (control_is_ready(box))
+		usb_submit_cancel(box);
+
 	// Process control messages
-	while (control_is_ready(box) && (m = clist_head(&box->ports[0].ready_messages_qn))) {
-		clist_remove(&m->queue_node);
+	while (control_is_ready(box) && (m = sched_take_msg(&box->ports[0]))) {
 		clist_add_tail(&box->control_messages_qn, &m->queue_node);
 		control_submit_message(m);
 	}
@@ -125,6 +428,10 @@ static int sched_handler(struct main_hook *hook)
 			break;
 		usb_submit_message(m);
 	}
+	usb_flush(box);
+
+	if (sched_has_ready(box))
+		usb_note_stall(box);
 
 	return HOOK_IDLE;
 }
@@ -156,16 +463,18 @@ static void persist_handler(struct main_timer *tm)
 	const char *filename = stk_printf("%s/%s", persistent_dir, box->cf->name);
 	const char *tmpname = stk_printf("%s.new", filename);
 	struct fastbuf *fb = bopen_try(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 4096);
-	bputsn(fb, "# baud parity powered timeout");
+	bputsn(fb, "# baud parity powered timeout queue_ttl retries");
 	bputsn(fb, "# >description");
 
 	for (int i=1; i<NUM_PORTS; i++) {
 		struct port *port = &box->ports[i];
-		bprintf(fb, "%d %d %d %d\n",
+		bprintf(fb, "%d %d %d %d %d %d\n",
 			port->baud_rate,
 			port->parity,
 			port->powered,
-			port->request_timeout
+			port->request_timeout,
+			port->queue_ttl,
+			port->retries
 			);
 		bprintf(fb, ">%.*s\n", PORT_DESCRIPTION_SIZE, port->description);
 	}
@@ -209,8 +518,9 @@ static void persist_load(struct box *box)
 			continue;
 		}
 
-		int baud, parity, powered, timeout;
-		if (sscanf(line, "%d%d%d%d", &baud, &parity, &powered, &timeout) != 4)
+		// Files written by older versions do not have queue_ttl and retries
+		int baud, parity, powered, timeout, queue_ttl = 0, retries = 0;
+		if (sscanf(line, "%d%d%d%d%d%d", &baud, &parity, &powered, &timeout, &queue_ttl, &retries) < 4)
 			die("%s:%d: Parse error", filename, lino);
 		if (i >= NUM_PORTS)
 			die("%s:%d: Too many ports", filename, lino);
@@ -220,6 +530,10 @@ static void persist_load(struct box *box)
 		port->parity = parity;
 		port->powered = powered;
 		port->request_timeout = timeout;
+		port->queue_ttl = queue_ttl;
+		port->retries = retries;
+		if (!control_check_port_params(port))
+			die("%s:%d: Invalid port settings", filename, lino);
 		i++;
 	}
 
@@ -238,6 +552,16 @@ void persist_schedule_write(struct box *box)
 		timer_add_rel(&box->persist_timer, 1000);
 }
 
+/*** Utilities ***/
+
+u64 get_time_us(void)
+{
+	// Monotonic time with a finer resolution than main_get_now()
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 /*** Logging ***/
 
 uint log_type_client;
@@ -267,6 +591,9 @@ static void port_init(struct box *box, int index)
 	port->port_number = index;
 	port->phys_number = 8 - index;
 	clist_init(&port->ready_messages_qn);
+	clist_init(&port->ready_clients_qn);
+	clist_init(&port->cache_list);
+	clist_init(&port->cache_free_list);
 
 	port->baud_rate = 19200;
 	port->parity = URS485_PARITY_EVEN;
@@ -289,6 +616,7 @@ static void box_init(struct box *box)
 	clist_init(&box->busy_messages_qn);
 	clist_init(&box->control_messages_qn);
 	clist_init(&box->orphaned_messages_cn);
+	msg_pool_init(box);
 
 	for (int i=0; i<NUM_PORTS; i++)
 		port_init(box, i);
@@ -296,6 +624,7 @@ static void box_init(struct box *box)
 	persist_load(box);
 
 	sched_init(box);
+	poll_init(box);
 
 	msg(L_INFO, "Switch %s: Listening on TCP ports %d-%d", box->cf->name,
 	    box->cf->tcp_port_base, box->cf->tcp_port_base + NUM_PORTS - 1);
@@ -22,6 +22,33 @@ enum usb_state {
 	USTATE_BROKEN,
 };
 
+// A bulk transfer together with its buffer
+struct usb_slot {
+	struct usb_context *usb;
+	struct libusb_transfer *transfer;
+	bool in_flight;
+	byte *data;			// Either buffer or a single message (see usb_submit_message())
+	uint length;
+	byte buffer[URS485_MAX_TRANSFER_SIZE];
+};
+
+// Bulk transfers used for one direction
+struct usb_pool {
+	struct usb_slot *slots;
+	uint num_slots;
+	uint in_flight;				// Number of slots with a transfer in flight
+};
+
+// Maximum size of device's window we accept
+#define USB_MAX_WINDOW 64
+
+// Why did the scheduler last stop submitting messages
+enum usb_tx_stall {
+	TX_STALL_NONE,
+	TX_STALL_WINDOW,			// Device has no free message slots
+	TX_STALL_TRANSFER,			// All bulk OUT transfers are in flight
+};
+
 struct usb_context {
 	struct box *box;
 	const char *switch_name;		// Used in debug messages
@@ -31,18 +58,43 @@ struct usb_context {
 
 	int bus, dev;				// -1 if device already unplugged
 	enum usb_state state;
+	bool batched;				// Protocol version 0x0200: multiple messages per transfer
+	bool has_timing;			// Protocol version 0x0300: timing field in message headers
+	uint msghdr_size;			// Size of message header in this protocol version
+	bool has_retries;			// Protocol version 0x0301: retries in port params and status
 
 	struct main_timer connect_timer;
-	u16 last_id;				// Last ID assigned to a message
+
+	// In-flight messages indexed by message ID
+	struct id_table ids;
 
 	struct libusb_device_handle *devh;
-	struct libusb_transfer *ctrl_transfer, *rx_transfer, *tx_transfer;
-	bool ctrl_in_flight, rx_in_flight, tx_in_flight;
+	struct libusb_transfer *ctrl_transfer;
+	bool ctrl_in_flight;
 
 	byte ctrl_buffer[256];
 
-	struct urs485_message rx_message, tx_message;
+	/*
+	 *  Flow control: the device has max_in_flight slots for messages, as reported
+	 *  by URS485_CONTROL_GET_CONFIG. Slots are either known to be free (tx_window),
+	 *  or occupied by our messages (ID_BUSY), or not yet returned by the device
+	 *  after reset (the device opens them by window open messages). The first two
+	 *  never exceed max_in_flight.
+	 */
+	uint max_in_flight;
 	uint tx_window;
+	enum usb_tx_stall tx_stall;
+
+	/*
+	 *  Bulk transfers: each in-flight OUT transfer holds a slot of the window
+	 *  and each slot produces one reply, so both pools are sized by the window.
+	 *  All IN transfers are kept queued, so that replies never wait for resubmission.
+	 *
+	 *  With batched framing, messages are collected in tx_open until the scheduler
+	 *  calls usb_flush(). The open slot is counted as in flight.
+	 */
+	struct usb_pool rx_pool, tx_pool;
+	struct usb_slot *tx_open;
 
 	// Which control message is being processed
 	enum urs485_control_request ctrl_current;
@@ -67,7 +119,50 @@ static clist hotplug_request_list;
 
 static void handle_hotplug(void);
 static void startup_scheduler(struct usb_context *u);
-static void rx_init(struct usb_context *u);
+static void rx_submit(struct usb_slot *s);
+
+static void pool_free(struct usb_pool *p)
+{
+	for (uint i=0; i < p->num_slots; i++) {
+		ASSERT(!p->slots[i].in_flight);
+		libusb_free_transfer(p->slots[i].transfer);
+	}
+	xfree(p->slots);
+	p->slots = NULL;
+	p->num_slots = 0;
+}
+
+static void pool_init(struct usb_context *u, struct usb_pool *p, uint size)
+{
+	// Keep the pool from the previous connection if the window did not change
+	if (size == p->num_slots)
+		return;
+
+	pool_free(p);
+	p->slots = xmalloc_zero(size * sizeof(struct usb_slot));
+	p->num_slots = size;
+	for (uint i=0; i < size; i++) {
+		struct usb_slot *s = &p->slots[i];
+		s->usb = u;
+		s->transfer = libusb_alloc_transfer(0);
+		ASSERT(s->transfer);
+	}
+}
+
+static struct usb_slot *pool_get_slot(struct usb_pool *p)
+{
+	for (uint i=0; i < p->num_slots; i++)
+		if (!p->slots[i].in_flight)
+			return &p->slots[i];
+	return NULL;
+}
+
+static void pool_cancel(struct usb_pool *p)
+{
+	for (uint i=0; i < p->num_slots; i++)
+		if (p->slots[i].in_flight)
+			libusb_cancel_transfer(p->slots[i].transfer);
+}
 
 static void FORMAT_CHECK(printf,2,3) usb_error(struct usb_context *u, const char *fmt, ...)
 {
@@ -79,10 +174,15 @@ static void FORMAT_CHECK(printf,2,3) usb_error(struct usb_context *u, const char
 	USB_MSG(u, L_ERROR, "%s", formatted_msg);
 	u->state = USTATE_BROKEN;
 
-	if (u->rx_in_flight)
-		libusb_cancel_transfer(u->rx_transfer);
-	if (u->tx_in_flight)
-		libusb_cancel_transfer(u->tx_transfer);
+	if (u->tx_open) {
+		// Never submitted, so there is nothing to cancel
+		u->tx_open->in_flight = false;
+		u->tx_pool.in_flight--;
+		u->tx_open = NULL;
+	}
+
+	pool_cancel(&u->rx_pool);
+	pool_cancel(&u->tx_pool);
 	if (u->ctrl_in_flight)
 		libusb_cancel_transfer(u->ctrl_transfer);
 }
@@ -95,37 +195,95 @@ bool usb_is_ready(struct box *box)
 	if (!u || u->state != USTATE_WORKING)
 		return true;
 
-	return (!u->tx_in_flight && u->tx_window > 0);
+	return ((u->tx_open || u->tx_pool.in_flight < u->tx_pool.num_slots) && u->tx_window > 0);
+}
+
+void usb_note_stall(struct box *box)
+{
+	// Called by the scheduler if messages are waiting, but usb_is_ready() said no.
+	// We count each stall only once, until the next message is submitted.
+
+	struct usb_context *u = box->usb;
+	if (!u || u->state != USTATE_WORKING)
+		return;
+
+	enum usb_tx_stall stall = u->tx_window ? TX_STALL_TRANSFER : TX_STALL_WINDOW;
+
+	if (stall == u->tx_stall)
+		return;
+
+	u->tx_stall = stall;
+	if (stall == TX_STALL_WINDOW)
+		box->cnt_tx_window_stalls++;
+	else
+		box->cnt_tx_transfer_stalls++;
 }
 
 static void tx_callback(struct libusb_transfer *xfer)
 {
-	struct usb_context *u = xfer->user_data;
+	struct usb_slot *s = xfer->user_data;
+	struct usb_context *u = s->usb;
 
 	USB_DBG(u, "Bulk TX done (status=%d, len=%d/%d)", xfer->status, xfer->actual_length, xfer->length);
-	u->tx_in_flight = false;
+	s->in_flight = false;
+	u->tx_pool.in_flight--;
 
 	if (xfer->status != LIBUSB_TRANSFER_COMPLETED)
 		usb_error(u, "Bulk TX transfer failed with status %d", xfer->status);
 }
 
-static void usb_gen_id(struct message *m)
+static void usb_zombie_timeout(struct main_timer *t)
 {
-	struct box *box = m->box;
-	struct usb_context *u = box->usb;
+	/*
+	 *  Not even a late reply arrived, so the switch has lost the message
+	 *  and the slot of its window would never be credited back. Resetting
+	 *  the device (see check_if_broken()) recovers the whole window.
+	 */
+	struct message *m = t->data;
+	struct usb_context *u = m->box->usb;
+	timer_del(t);
 
-	for (;;) {
-		u->last_id++;
-		bool used = false;
-		CLIST_FOR_EACH(struct message *, n, box->busy_messages_qn)
-			if (n != m && n->usb_message_id == u->last_id) {
-				used = true;
-				break;
-			}
-		if (!used) {
-			m->usb_message_id = u->last_id;
-			return;
-		}
+	if (u && u->state == USTATE_WORKING)
+		usb_error(u, "Message #%04x for port %u was lost by the switch", m->usb_message_id, m->port->port_number);
+}
+
+static void usb_reply_timeout(struct main_timer *t)
+{
+	/*
+	 *  The switch did not reply in time. The client gets an error, but the
+	 *  message stays in flight as a zombie: the device may still hold it in
+	 *  a slot of its window and reply late, so we keep its ID and do not
+	 *  credit the slot until the reply arrives or the device is reset.
+	 *  If it is still queued in the switch, we ask for cancelling it.
+	 *  The late reply must arrive within another reply timeout.
+	 */
+	struct message *m = t->data;
+	struct usb_context *u = m->box->usb;
+	timer_del(t);
+
+	USB_MSG(u, L_WARN, "No reply to message #%04x for port %u", m->usb_message_id, m->port->port_number);
+	m->box->cnt_lost_replies++;
+	msg_fail_in_flight(m, MODBUS_ERR_GATEWAY_TARGET_DEVICE_FAILED);
+	usb_cancel_message(m);
+
+	m->reply_timer.handler = usb_zombie_timeout;
+	timer_add_rel(t, sched_reply_timeout(m, u->max_in_flight) / 1000);
+}
+
+static void tx_submit_open(struct usb_context *u)
+{
+	struct usb_slot *s = u->tx_open;
+	if (!s)
+		return;
+	u->tx_open = NULL;
+
+	libusb_fill_bulk_transfer(s->transfer, u->devh, 0x01, s->data, s->length, tx_callback, s, 5000);
+
+	int err;
+	if (err = libusb_submit_transfer(s->transfer)) {
+		s->in_flight = false;
+		u->tx_pool.in_flight--;
+		usb_error(u, "Cannot submit bulk TX transfer: error %d", err);
 	}
 }
 
@@ -134,68 +292,126 @@ void usb_submit_message(struct message *m)
 	// To be called only after usb_is_ready() returns true
 
 	struct usb_context *u = m->box->usb;
-	if (u->state != USTATE_WORKING) {
+	if (!u || u->state != USTATE_WORKING) {
 		msg_send_error_reply(m, MODBUS_ERR_GATEWAY_PATH_UNAVAILABLE);
 		return;
 	}
 
-	ASSERT(!u->tx_in_flight && u->tx_window > 0);
+	struct usb_slot *s = u->tx_open;
+	if (!s) {
+		s = pool_get_slot(&u->tx_pool);
+		ASSERT(s);
+		s->in_flight = true;
+		s->data = s->buffer;
+		s->length = 0;
+		u->tx_pool.in_flight++;
+		u->tx_open = s;
+	}
+	ASSERT(u->tx_window > 0);
 	u->tx_window--;
+	u->tx_stall = TX_STALL_NONE;
 
-	usb_gen_id(m);
+	id_alloc(&u->ids, m);
+	m->reply_timer.handler = usb_reply_timeout;
+	m->reply_timer.data = m;
+	timer_add_rel(&m->reply_timer, sched_reply_timeout(m, u->max_in_flight) / 1000);
 
-	struct urs485_message *tm = &u->tx_message;
+	// The header is constructed in place in front of the request
+	struct urs485_message *tm = (struct urs485_message *) (m->request - u->msghdr_size);
 	tm->port = m->port->phys_number;
 	tm->frame_size = m->request_size;
 	put_u16_le(&tm->message_id, m->usb_message_id);
-	memcpy(tm->frame, m->request, m->request_size);
+	if (u->has_timing) {
+		m->usb_timeout = timing_timeout(m);
+		put_u16_le(&tm->timing, m->usb_timeout);
+	}
+	uint size = u->msghdr_size + m->request_size;
 
-	USB_DBG(u, "TX: port=%d, frame_size=%d, msg_id=%04x", tm->port, tm->frame_size, m->usb_message_id);
+	USB_DBG(u, "TX: port=%d, frame_size=%d, msg_id=%04x, timeout=%u", tm->port, tm->frame_size, m->usb_message_id, m->usb_timeout);
+
+	if (!u->batched) {
+		// A single message per transfer, so it is sent directly from struct message,
+		// which lives until the reply arrives or the device is flushed (after all
+		// transfers complete), even if its reply times out (see usb_reply_timeout())
+		s->data = (byte *) tm;
+		s->length = size;
+		tx_submit_open(u);
+		return;
+	}
 
-	uint tx_size = offsetof(struct urs485_message, frame) + m->request_size;
-	libusb_fill_bulk_transfer(u->tx_transfer, u->devh, 0x01, (unsigned char *) &u->tx_message, tx_size, tx_callback, u, 5000);
+	memcpy(s->buffer + s->length, tm, size);
+	s->length += size;
 
-	int err;
-	if (err = libusb_submit_transfer(u->tx_transfer))
-		usb_error(u, "Cannot submit bulk TX transfer: error %d", err);
-	else
-		u->tx_in_flight = true;
+	// Keep room for a message of maximum size in the open slot
+	if (s->length + sizeof(struct urs485_message) > URS485_MAX_TRANSFER_SIZE)
+		tx_submit_open(u);
+}
+
+void usb_flush(struct box *box)
+{
+	struct usb_context *u = box->usb;
+	if (u)
+		tx_submit_open(u);
+}
+
+static void tx_add_credit(struct usb_context *u)
+{
+	// The device returned a slot of its window to us
+	if (u->tx_window + ID_BUSY(&u->ids) >= u->max_in_flight) {
+		USB_MSG(u, L_ERROR, "Protocol error: Device opened more than the negotiated window of %u messages", u->max_in_flight);
+		return;
+	}
+	u->tx_window++;
 }
 
-static void rx_process_msg(struct usb_context *u)
+static void rx_process_msg(struct usb_context *u, struct urs485_message *rm)
 {
-	struct urs485_message *rm = &u->rx_message;
 	u16 msg_id = get_u16_le(&rm->message_id);
 	USB_DBG(u, "RX: port=%d, frame_size=%d, msg_id=%04x", rm->port, rm->frame_size, msg_id);
 
-	if (rm->port == 0xff) {
+	if (u->batched && rm->port == URS485_PORT_CREDIT) {
+		// The device grants msg_id slots of its window
+		for (uint i=0; i < msg_id; i++)
+			tx_add_credit(u);
+		return;
+	}
+
+	if (!u->batched && rm->port == URS485_PORT_WINDOW_OPEN) {
 		// It was a window open message
+		tx_add_credit(u);
 		return;
 	}
 
-	CLIST_FOR_EACH(struct message *, m, u->box->busy_messages_qn) {
-		if (m->usb_message_id == msg_id) {
-			m->reply_size = rm->frame_size;
-			ASSERT(m->reply_size < sizeof(m->reply));
-			memcpy(m->reply, rm->frame, m->reply_size);
-			msg_send_reply(m);
-			return;
-		}
+	struct message *m = id_find(&u->ids, msg_id);
+	if (!m) {
+		USB_MSG(u, L_WARN, "Switch replied to an unknown message #%04x", msg_id);
+		return;
 	}
 
-	USB_MSG(u, L_WARN, "Switch replied to an unknown message #%04x", msg_id);
+	id_free(&u->ids, m);
+	tx_add_credit(u);
+
+	m->reply_size = rm->frame_size;
+	ASSERT(m->reply_size < sizeof(m->reply));
+	memcpy(m->reply, (byte *) rm + u->msghdr_size, m->reply_size);
+	m->reply_time = get_time_us();
+	if (u->has_timing)
+		timing_update(m, get_u16_le(&rm->timing));
+	msg_send_reply(m);
 }
 
 static void rx_callback(struct libusb_transfer *xfer)
 {
-	struct usb_context *u = xfer->user_data;
+	struct usb_slot *s = xfer->user_data;
+	struct usb_context *u = s->usb;
 
 	USB_DBG(u, "Bulk RX done (status=%d, len=%d/%d)", xfer->status, xfer->actual_length, xfer->length);
-	u->rx_in_flight = false;
+	s->in_flight = false;
+	u->rx_pool.in_flight--;
 
 	if (xfer->status == LIBUSB_TRANSFER_TIMED_OUT) {
 		// Should not happen
-		rx_init(u);
+		rx_submit(s);
 		return;
 	}
 
@@ -204,23 +420,46 @@ static void rx_callback(struct libusb_transfer *xfer)
 		return;
 	}
 
-	rx_process_msg(u);
+	/*
+	 *  The other slots of the ring are still queued, so the device can
+	 *  send further replies while we are processing this one.
+	 */
+	byte *pos = s->buffer;
+	byte *end = pos + xfer->actual_length;
+	while (pos < end && u->state == USTATE_WORKING) {
+		struct urs485_message *rm = (struct urs485_message *) pos;
+		if (end - pos < (int) u->msghdr_size || end - pos < (int) u->msghdr_size + rm->frame_size) {
+			usb_error(u, "Protocol error: Truncated message in bulk RX transfer");
+			return;
+		}
+		rx_process_msg(u, rm);
+		pos += u->msghdr_size + rm->frame_size;
+	}
 
-	u->tx_window++;
-	rx_init(u);
+	if (u->state == USTATE_WORKING)
+		rx_submit(s);
 }
 
-static void rx_init(struct usb_context *u)
+static void rx_submit(struct usb_slot *s)
 {
-	ASSERT(!u->rx_in_flight);
+	struct usb_context *u = s->usb;
+	ASSERT(!s->in_flight);
 
-	libusb_fill_bulk_transfer(u->rx_transfer, u->devh, 0x82, (unsigned char *) &u->rx_message, sizeof(u->rx_message), rx_callback, u, 0);
+	libusb_fill_bulk_transfer(s->transfer, u->devh, 0x82, s->buffer, (u->batched ? URS485_MAX_TRANSFER_SIZE : sizeof(struct urs485_message)), rx_callback, s, 0);
 
 	int err;
-	if (err = libusb_submit_transfer(u->rx_transfer))
+	if (err = libusb_submit_transfer(s->transfer))
 		usb_error(u, "Cannot submit bulk RX transfer: error %d", err);
-	else
-		u->rx_in_flight = true;
+	else {
+		s->in_flight = true;
+		u->rx_pool.in_flight++;
+	}
+}
+
+static void rx_init(struct usb_context *u)
+{
+	for (uint i=0; i < u->rx_pool.num_slots && u->state == USTATE_WORKING; i++)
+		rx_submit(&u->rx_pool.slots[i]);
 }
 
 static void ctrl_callback(struct libusb_transfer *xfer)
@@ -230,6 +469,15 @@ static void ctrl_callback(struct libusb_transfer *xfer)
 	USB_DBG(u, "Ctrl done (status=%d, len=%d/%d)", xfer->status, xfer->actual_length, xfer->length);
 	u->ctrl_in_flight = false;
 
+	if (u->ctrl_current == URS485_CONTROL_CANCEL_MESSAGE) {
+		// Stalled if the message is already being transmitted, which is not an error
+		if (xfer->status != LIBUSB_TRANSFER_COMPLETED && xfer->status != LIBUSB_TRANSFER_STALL)
+			usb_error(u, "Control transfer failed with status %d", xfer->status);
+		u->ctrl_current = 0;
+		u->ctrl_port = NULL;
+		return;
+	}
+
 	if (xfer->status != LIBUSB_TRANSFER_COMPLETED) {
 		usb_error(u, "Control transfer failed with status %d", xfer->status);
 		return;
@@ -238,7 +486,16 @@ static void ctrl_callback(struct libusb_transfer *xfer)
 	switch (u->ctrl_current) {
 		case URS485_CONTROL_GET_CONFIG: {
 			struct urs485_config *cf = (struct urs485_config *)(u->ctrl_buffer + 8);
-			USB_DBG(u, "max_in_flight=%d", get_u16(&cf->max_in_flight));
+			uint max_in_flight = get_u16_le(&cf->max_in_flight);
+			USB_DBG(u, "max_in_flight=%d", max_in_flight);
+			if (xfer->actual_length < (int) sizeof(struct urs485_config) || !max_in_flight || max_in_flight > USB_MAX_WINDOW) {
+				usb_error(u, "Device reports unsupported window of %u messages", max_in_flight);
+				return;
+			}
+			u->max_in_flight = max_in_flight;
+			msg_pool_prewarm(u->box, max_in_flight);
+			pool_init(u, &u->rx_pool, max_in_flight);
+			pool_init(u, &u->tx_pool, max_in_flight);
 			break;
 		}
 		case URS485_CONTROL_GET_PORT_STATUS: {
@@ -253,6 +510,8 @@ static void ctrl_callback(struct libusb_transfer *xfer)
 			port->cnt_crc_errors = get_u32_le(&ps->cnt_crc_errors);
 			port->cnt_mismatch_errors = get_u32_le(&ps->cnt_mismatch_errors);
 			port->cnt_timeouts = get_u32_le(&ps->cnt_timeouts);
+			if (xfer->actual_length >= (int) sizeof(struct urs485_port_status))
+				port->cnt_retries = get_u32_le(&ps->cnt_retries);
 			break;
 		}
 		default: ;
@@ -270,7 +529,7 @@ static void ctrl_callback(struct libusb_transfer *xfer)
 	}
 }
 
-static void usb_submit_ctrl(struct usb_context *u, struct port *port, enum urs485_control_request req, bool direction_out, uint data_size)
+static void usb_submit_ctrl(struct usb_context *u, struct port *port, enum urs485_control_request req, uint value, bool direction_out, uint data_size)
 {
 	u->ctrl_current = req;
 	u->ctrl_port = port;
@@ -278,7 +537,7 @@ static void usb_submit_ctrl(struct usb_context *u, struct port *port, enum urs48
 	libusb_fill_control_setup(u->ctrl_buffer,
 		(direction_out ? LIBUSB_ENDPOINT_OUT : LIBUSB_ENDPOINT_IN) | LIBUSB_REQUEST_TYPE_VENDOR,
 		req,
-		0,
+		value,
 		(port ? port->phys_number : 0),
 		data_size);
 
@@ -298,7 +557,7 @@ bool usb_submit_get_port_status(struct port *port)
 		return false;
 
 	USB_DBG(u, "GET_PORT_STATUS on port %d", port->port_number);
-	usb_submit_ctrl(u, port, URS485_CONTROL_GET_PORT_STATUS, false, sizeof(struct urs485_port_status));
+	usb_submit_ctrl(u, port, URS485_CONTROL_GET_PORT_STATUS, 0, false, sizeof(struct urs485_port_status));
 	return true;
 }
 
@@ -314,8 +573,12 @@ bool usb_submit_set_port_params(struct port *port)
 	pp->parity = port->parity;
 	pp->powered = port->powered;
 	put_u16_le(&pp->request_timeout, port->request_timeout);
+	pp->retries = port->retries;
+	memset(pp->rfu, 0, sizeof(pp->rfu));
 
-	usb_submit_ctrl(u, port, URS485_CONTROL_SET_PORT_PARAMS, true, sizeof(struct urs485_port_params));
+	// Older versions do not know about retries
+	uint size = u->has_retries ? sizeof(struct urs485_port_params) : offsetof(struct urs485_port_params, retries);
+	usb_submit_ctrl(u, port, URS485_CONTROL_SET_PORT_PARAMS, 0, true, size);
 	return true;
 }
 
@@ -325,10 +588,49 @@ bool usb_submit_reset_port_stats(struct port *port)
 	if (!u)
 		return false;
 	USB_DBG(u, "RESET_PORT_STATS on port %d", port->port_number);
-	usb_submit_ctrl(u, port, URS485_CONTROL_RESET_STATS, true, 0);
+	usb_submit_ctrl(u, port, URS485_CONTROL_RESET_STATS, 0, true, 0);
 	return true;
 }
 
+bool usb_ctrl_is_busy(struct box *box)
+{
+	struct usb_context *u = box->usb;
+	return (u && u->ctrl_in_flight);
+}
+
+void usb_cancel_message(struct message *m)
+{
+	/*
+	 *  An orphaned message, whose reply nobody waits for, need not use
+	 *  bus time. If it is still queued in the switch, we cancel it there.
+	 *  Messages in flight only as a part of another one are not on the bus
+	 *  by themselves, and messages with followers are still needed.
+	 */
+	struct usb_context *u = m->box->usb;
+	if (u && u->state == USTATE_WORKING && m->in_flight && !m->leader && clist_empty(&m->followers_qn))
+		m->cancel = CANCEL_PENDING;
+}
+
+bool usb_submit_cancel(struct box *box)
+{
+	// To be called only when the control endpoint is not used by control messages
+	struct usb_context *u = box->usb;
+	if (!u || u->state != USTATE_WORKING || u->ctrl_in_flight)
+		return false;
+
+	CLIST_FOR_EACH(cnode *, n, box->orphaned_messages_cn) {
+		struct message *m = SKIP_BACK(struct message, client_node, n);
+		if (m->cancel == CANCEL_PENDING) {
+			USB_DBG(u, "CANCEL_MESSAGE #%04x on port %d", m->usb_message_id, m->port->port_number);
+			m->cancel = CANCEL_SENT;
+			usb_submit_ctrl(u, m->port, URS485_CONTROL_CANCEL_MESSAGE, m->usb_message_id, true, 0);
+			return true;
+		}
+	}
+
+	return false;
+}
+
 static void startup_scheduler(struct usb_context *u)
 {
 	// State machine for the initialization sequence
@@ -336,7 +638,7 @@ static void startup_scheduler(struct usb_context *u)
 
 	if (u->state == USTATE_GET_DEV_CONFIG) {
 		USB_DBG(u, "Init: Get device config");
-		usb_submit_ctrl(u, NULL, URS485_CONTROL_GET_CONFIG, false, sizeof(struct urs485_config));
+		usb_submit_ctrl(u, NULL, URS485_CONTROL_GET_CONFIG, 0, false, sizeof(struct urs485_config));
 	} else if (u->state < USTATE_WORKING) {
 		uint port_number = u->state - USTATE_SET_PORT_CONFIG + 1;
 		USB_DBG(u, "Init: Setting up port %d", port_number);
@@ -361,8 +663,11 @@ static void connect_handler(struct main_timer *timer)
 		return;
 	}
 
-	ASSERT(!u->ctrl_in_flight && !u->rx_in_flight && !u->tx_in_flight);
+	ASSERT(!u->ctrl_in_flight && !u->rx_pool.in_flight && !u->tx_pool.in_flight);
+	u->max_in_flight = 0;
 	u->tx_window = 0;
+	u->tx_stall = TX_STALL_NONE;
+	id_table_init(&u->ids);
 
 	u->state = USTATE_GET_DEV_CONFIG;
 	startup_scheduler(u);
@@ -375,7 +680,7 @@ static void check_if_broken(struct usb_context *u)
 		return;
 
 	// If there are still in-flight transfers, wait for them to complete
-	if (u->ctrl_in_flight || u->rx_in_flight || u->tx_in_flight)
+	if (u->ctrl_in_flight || u->rx_pool.in_flight || u->tx_pool.in_flight)
 		return;
 
 	USB_DBG(u, "Leaving broken device");
@@ -388,6 +693,7 @@ static void check_if_broken(struct usb_context *u)
 		msg_send_error_reply(m, MODBUS_ERR_GATEWAY_PATH_UNAVAILABLE);
 	while (m = clist_head(&box->control_messages_qn))
 		msg_send_error_reply(m, MODBUS_ERR_GATEWAY_PATH_UNAVAILABLE);
+	id_table_init(&u->ids);
 
 	if (u->bus < 0) {
 		// Device already unplugged, so dismantle the USB context
@@ -401,8 +707,8 @@ static void check_if_broken(struct usb_context *u)
 		}
 
 		libusb_free_transfer(u->ctrl_transfer);
-		libusb_free_transfer(u->rx_transfer);
-		libusb_free_transfer(u->tx_transfer);
+		pool_free(&u->rx_pool);
+		pool_free(&u->tx_pool);
 
 		xfree(u);
 		box->usb = NULL;
@@ -450,7 +756,7 @@ static void hotplug_connect(struct hotplug_request *hr)
 		return;
 	}
 
-	if (desc.bcdDevice != 0x0100) {
+	if (desc.bcdDevice != 0x0100 && desc.bcdDevice != 0x0200 && desc.bcdDevice != 0x0300 && desc.bcdDevice != 0x0301) {
 		HR_MSG(hr, L_ERROR, "Unsupported hardware revision %04x", desc.bcdDevice);
 		return;
 	}
@@ -482,6 +788,10 @@ static void hotplug_connect(struct hotplug_request *hr)
 	u->switch_name = box->cf->name;
 	snprintf(u->hw_revision, sizeof(u->hw_revision), "%02x.%02x", desc.bcdDevice >> 8, desc.bcdDevice & 0xff);
 	strcpy(u->serial_number, (char *) serial);
+	u->batched = (desc.bcdDevice >= 0x0200);
+	u->has_timing = (desc.bcdDevice >= 0x0300);
+	u->msghdr_size = (u->has_timing ? URS485_MSGHDR_SIZE : URS485_MSGHDR_SIZE_V2);
+	u->has_retries = (desc.bcdDevice >= 0x0301);
 	box->usb = u;
 
 	USB_MSG(u, L_INFO, "Connected on %s (serial number %s, revision %s)", hr->name, serial, u->hw_revision);
@@ -492,9 +802,7 @@ static void hotplug_connect(struct hotplug_request *hr)
 	u->devh = devh;
 
 	u->ctrl_transfer = libusb_alloc_transfer(0);
-	u->rx_transfer = libusb_alloc_transfer(0);
-	u->tx_transfer = libusb_alloc_transfer(0);
-	ASSERT(u->ctrl_transfer && u->rx_transfer && u->tx_transfer);
+	ASSERT(u->ctrl_transfer);
 
 	u->connect_timer.handler = connect_handler;
 	u->connect_timer.data = u;
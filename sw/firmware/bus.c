@@ -8,6 +8,7 @@
 #include "modbus-proto.h"
 
 #include <libopencm3/cm3/nvic.h>
+#include <libopencm3/stm32/dma.h>
 #include <libopencm3/stm32/gpio.h>
 #include <libopencm3/stm32/timer.h>
 #include <libopencm3/stm32/usart.h>
@@ -23,10 +24,14 @@
 #endif
 
 struct channel {
-	struct message_queue send_queue;
+	struct message_queue send_queue[4];	// one per port, indexed by port % 4
+	byte next_queue;		// round-robin pointer to send_queue[]
 	struct message_node *current;
+	byte retries_left;		// for current message
 	u32 usart;
 	u32 timer;
+	byte dma_tx;			// DMA1 channels serving the USART
+	byte dma_rx;
 
 	byte id;
 	byte state;			// STATE_xxx
@@ -37,19 +42,21 @@ struct channel {
 	struct urs485_port_status *port_status;
 
 	u16 rx_char_timeout;
+	u16 rx_idle_delay;		// rx_char_timeout minus the character time detected by USART IDLE
 	u16 inter_frame_gap;
 
 	u32 transaction_start_time;	// time at the start of transaction
 	u32 transaction_end_time;	// ... at the end of transaction
 
 	byte *tx_buf;
-	u16 tx_pos;
 	u16 tx_size;
 
 	byte rx_buf[256];
-	u16 rx_size;
+	u16 rx_size;			// updated only when the line becomes idle or a DMA transfer completes
+	u16 rx_dma_end;			// where the current DMA transfer ends in rx_buf[]
 	u16 rx_timeout;			// in ms
 	u32 rx_start_at;		// ms_ticks when RX started
+	u32 rx_first_at;		// ms_ticks when the first character was received
 	byte rx_bad;
 };
 
@@ -59,7 +66,6 @@ enum mb_state {
 	STATE_IDLE,			// iff channel->current == NULL
 	STATE_GAP,			// inter-frame gap
 	STATE_TX,
-	STATE_TX_LAST,
 	STATE_TX_DONE,
 	STATE_RX,
 	STATE_RX_DONE,
@@ -72,6 +78,8 @@ enum mb_rx_bad {
 	RX_BAD_OVERSIZE,
 };
 
+#define RX_HEADER_SIZE 3		// enough to determine size of the reply, see channel_rx_expected_size()
+
 // State related to port LEDs
 static byte led_active_mask;		// ports currently active
 static byte led_history_mask;		// ports active since last recalculation
@@ -81,11 +89,12 @@ bool set_port_params(uint port, struct urs485_port_params *par)
 	if (par->baud_rate < 1200 || par->baud_rate > 115200 ||
 	    par->parity > 2 ||
 	    par->powered > 1 ||
+	    par->retries > 5 ||
 	    !par->request_timeout)
 		return false;
 
-	DEBUG("Setting up port %u (rate=%u, par=%u, power=%u, timeout=%u)\n",
-		port, (uint) par->baud_rate, par->parity, par->powered, par->request_timeout);
+	DEBUG("Setting up port %u (rate=%u, par=%u, power=%u, timeout=%u, retries=%u)\n",
+		port, (uint) par->baud_rate, par->parity, par->powered, par->request_timeout, par->retries);
 	ports[port].params = *par;
 
 	if (par->powered)
@@ -113,6 +122,7 @@ void reset_port_stats(uint port)
 	s->cnt_crc_errors = 0;
 	s->cnt_mismatch_errors = 0;
 	s->cnt_timeouts = 0;
+	s->cnt_retries = 0;
 }
 
 static void internal_error_reply(struct message_node *n, byte error_code)
@@ -120,11 +130,27 @@ static void internal_error_reply(struct message_node *n, byte error_code)
 	struct urs485_message *m = &n->msg;
 	DEBUG("Msg #%04x: Internal error %d\n", m->message_id, error_code);
 	m->frame_size = 3;
+	m->timing = 0;
 	m->frame[1] |= 0x80;
 	m->frame[2] = error_code;
 	queue_put(&done_queue, n);
 }
 
+bool cancel_message(uint port, u16 message_id)
+{
+	// Messages which are already being transmitted cannot be cancelled
+	struct message_queue *q = &channels[port/4].send_queue[port%4];
+	struct message_node *prev = NULL;
+	for (struct message_node *n = q->first; n; prev = n, n = n->next)
+		if (n->msg.message_id == message_id) {
+			DEBUG("Msg #%04x: Cancelled\n", message_id);
+			queue_remove(q, n, prev);
+			internal_error_reply(n, MODBUS_ERR_GATEWAY_PATH_UNAVAILABLE);
+			return true;
+		}
+	return false;
+}
+
 static void channel_activate_port(struct channel *c, uint port)
 {
 	if (c->active_port != port || c->port_stale) {
@@ -169,9 +195,12 @@ static void channel_activate_port(struct channel *c, uint port)
 			c->inter_frame_gap = 1750;
 		}
 
+		// USART signals IDLE after 1 character time of silence
+		u16 char_time = 1000000*11/par->baud_rate;
+		c->rx_idle_delay = (c->rx_char_timeout > char_time) ? c->rx_char_timeout - char_time : 1;
+
 		c->active_port = port;
 		c->port_stale = false;
-		c->rx_timeout = par->request_timeout;
 		c->port_state = state;
 		c->port_status = &state->status;
 	}
@@ -193,43 +222,62 @@ static void channel_tx_init(struct channel *c)
 	c->state = STATE_TX;
 	c->transaction_start_time = get_current_time();
 	c->tx_buf = c->current->msg.frame;
-	c->tx_pos = 0;
 	c->tx_size = c->current->msg.frame_size + 2;
 
-	usart_set_mode(c->usart, USART_MODE_TX);
-	usart_enable_tx_interrupt(c->usart);
-
 	reg_set_flag(c->active_port, SF_TXEN | SF_RXEN_N);
 	reg_send();
+
+	// The frame is sent by DMA, we get a single interrupt when the last byte leaves the shift register
+	dma_disable_channel(DMA1, c->dma_tx);
+	dma_set_memory_address(DMA1, c->dma_tx, (u32) c->tx_buf);
+	dma_set_number_of_data(DMA1, c->dma_tx, c->tx_size);
+	usart_set_mode(c->usart, USART_MODE_TX);
+	USART_SR(c->usart) &= ~USART_SR_TC;
+	usart_enable_tx_dma(c->usart);
+	dma_enable_channel(DMA1, c->dma_tx);
+	USART_CR1(c->usart) |= USART_CR1_TCIE;
 }
 
 static void channel_tx_done(struct channel *c)
 {
 	c->state = STATE_TX_DONE;
-	// usart_disable_tx_interrupt(c->usart);		// Already done by irq handler
+	USART_CR1(c->usart) &= ~USART_CR1_TCIE;
+	usart_disable_tx_dma(c->usart);
+	dma_disable_channel(DMA1, c->dma_tx);
 }
 
 static void channel_tx_gap(struct channel *c)
 {
-	u32 gap = get_current_time() - c->port_state->last_transaction_end_time;
+	/*
+	 *  The gap is counted from the end of the last transaction, which can
+	 *  lie in the future if the reply ended early (see channel_dma_rx_isr()).
+	 *  If we have to wait longer than possible, the port was idle for so long
+	 *  that the current time has overflowed.
+	 */
 	u32 minimum_gap = (c->inter_frame_gap - c->rx_char_timeout) * MICROSECOND;
-	if (gap + MICROSECOND >= minimum_gap) {
+	s32 wait = c->port_state->last_transaction_end_time + minimum_gap - get_current_time();
+	if (wait <= (s32) MICROSECOND || wait > (s32) (c->inter_frame_gap * MICROSECOND)) {
 		channel_tx_init(c);
 	} else {
-		/*
-		 *  It is possible that if the port was idle for a long time,
-		 *  the current time has overflowed. In that case, we might
-		 *  insert an unnecessary delay. Since the delay is short and
-		 *  the probablity of this happening quite small, we do not care.
-		 */
-		CDEBUG(c, "Inter-frame gap: %u ticks\n", (uint)(minimum_gap - gap));
+		CDEBUG(c, "Inter-frame gap: %u ticks\n", (uint) wait);
 		c->state = STATE_GAP;
-		timer_set_period(c->timer, (minimum_gap - gap) / MICROSECOND);	// at least 1
+		timer_set_period(c->timer, wait / MICROSECOND);	// at least 1
 		timer_generate_event(c->timer, TIM_EGR_UG);
 		timer_enable_counter(c->timer);
 	}
 }
 
+static void channel_rx_dma(struct channel *c, uint start, uint size)
+{
+	// If a character arrives while DMA is disabled, it waits in the USART until DMA is enabled again
+	dma_disable_channel(DMA1, c->dma_rx);
+	dma_clear_interrupt_flags(DMA1, c->dma_rx, DMA_TCIF);
+	dma_set_memory_address(DMA1, c->dma_rx, (u32) (c->rx_buf + start));
+	dma_set_number_of_data(DMA1, c->dma_rx, size);
+	dma_enable_channel(DMA1, c->dma_rx);
+	c->rx_dma_end = start + size;
+}
+
 static void channel_rx_init(struct channel *c)
 {
 	c->state = STATE_RX;
@@ -237,29 +285,90 @@ static void channel_rx_init(struct channel *c)
 	c->rx_bad = RX_BAD_OK;
 	c->rx_start_at = ms_ticks;
 
+	// The host can ask for a shorter timeout than the port's one
+	c->rx_timeout = c->port_state->params.request_timeout;
+	u16 timeout = c->current->msg.timing;
+	if (timeout && timeout < c->rx_timeout)
+		c->rx_timeout = timeout;
+
 	reg_clear_flag(c->active_port, SF_TXEN | SF_RXEN_N);
 	reg_send();
 
+	/*
+	 *  Characters are stored by DMA: first the header, then the rest
+	 *  of the frame, whose size is given by the header if known.
+	 *  We get interrupts for the first character (to record rx_first_at),
+	 *  at the end of each DMA transfer, for receive errors, and when
+	 *  the line becomes idle.
+	 */
+	channel_rx_dma(c, 0, RX_HEADER_SIZE);
+
+	(void) USART_SR(c->usart);		// Clear stale IDLE and error flags
+	(void) USART_DR(c->usart);
+	usart_enable_rx_dma(c->usart);
 	usart_set_mode(c->usart, USART_MODE_RX);
-	usart_enable_rx_interrupt(c->usart);
+	USART_CR1(c->usart) |= USART_CR1_RXNEIE | USART_CR1_IDLEIE | USART_CR1_PEIE;
+	USART_CR3(c->usart) |= USART_CR3_EIE;
+}
+
+static uint channel_rx_count(struct channel *c)
+{
+	// Number of characters stored by DMA so far
+	return c->rx_dma_end - dma_get_number_of_data(DMA1, c->dma_rx);
 }
 
 static void channel_rx_done(struct channel *c)
 {
 	c->state = STATE_RX_DONE;
-	usart_disable_rx_interrupt(c->usart);
+	USART_CR1(c->usart) &= ~(USART_CR1_RXNEIE | USART_CR1_IDLEIE | USART_CR1_PEIE);
+	USART_CR3(c->usart) &= ~USART_CR3_EIE;
 	usart_set_mode(c->usart, 0);
-	timer_disable_counter(c->usart);
+	usart_disable_rx_dma(c->usart);
+	dma_disable_channel(DMA1, c->dma_rx);
+	timer_disable_counter(c->timer);
+	c->rx_size = channel_rx_count(c);
 	c->transaction_end_time = get_current_time();
 }
 
+static uint channel_rx_expected_size(struct channel *c)
+{
+	// Size of the reply including CRC as implied by its function code, 0 if not known (yet)
+	if (c->rx_size < 2)
+		return 0;
+
+	uint func = c->rx_buf[1];
+	if (func & 0x80)
+		return 5;				// exception: address, function, code, CRC
+
+	switch (func) {
+		case MODBUS_FUNC_READ_COILS:
+		case MODBUS_FUNC_READ_DISCRETE_INPUTS:
+		case MODBUS_FUNC_READ_HOLDING_REGISTERS:
+		case MODBUS_FUNC_READ_INPUT_REGISTERS:
+		case MODBUS_FUNC_READ_WRITE_MULTIPLE_REGISTERS:
+			// Byte count follows the function code
+			return (c->rx_size >= 3) ? 5 + c->rx_buf[2] : 0;
+		case MODBUS_FUNC_WRITE_SINGLE_COIL:
+		case MODBUS_FUNC_WRITE_SINGLE_REGISTER:
+		case MODBUS_FUNC_WRITE_MULTIPLE_COILS:
+		case MODBUS_FUNC_WRITE_MULTIPLE_REGISTERS:
+			return 8;
+		case MODBUS_FUNC_MASK_WRITE_REGISTER:
+			return 10;
+		default:
+			return 0;
+	}
+}
+
 static void channel_timer_isr(struct channel *c)
 {
 	if (TIM_SR(c->timer) & TIM_SR_UIF) {
 		TIM_SR(c->timer) &= ~TIM_SR_UIF;
-		if (c->state == STATE_RX)
-			channel_rx_done(c);
-		else if (c->state == STATE_GAP)
+		if (c->state == STATE_RX) {
+			// If more characters arrived since the line became idle, wait for the next IDLE
+			if (channel_rx_count(c) == c->rx_size)
+				channel_rx_done(c);
+		} else if (c->state == STATE_GAP)
 			channel_tx_init(c);
 	}
 }
@@ -268,39 +377,42 @@ static void channel_usart_isr(struct channel *c)
 {
 	u32 status = USART_SR(c->usart);
 
-	if (status & USART_SR_RXNE) {
-		uint ch = usart_recv(c->usart);
-		if (c->state == STATE_RX) {
-			if (status & (USART_SR_FE | USART_SR_ORE | USART_SR_NE)) {
-				c->rx_bad = RX_BAD_CHAR;
-			} else if (c->rx_size < 256) {
-				c->rx_buf[c->rx_size++] = ch;
-			} else {
-				// Frame too long
-				c->rx_bad = RX_BAD_OVERSIZE;
-			}
-			timer_set_period(c->timer, c->rx_char_timeout);
-			timer_generate_event(c->timer, TIM_EGR_UG);
-			timer_enable_counter(c->timer);
+	if (c->state == STATE_RX) {
+		if (USART_CR1(c->usart) & USART_CR1_RXNEIE) {
+			// The first character (DMA takes care of the rest)
+			c->rx_first_at = ms_ticks;
+			usart_disable_rx_interrupt(c->usart);
 		}
-	}
 
-	if (c->state == STATE_TX) {
-		if (status & USART_SR_TXE) {
-			if (c->tx_pos < c->tx_size) {
-				usart_send(c->usart, c->tx_buf[c->tx_pos++]);
-			} else {
-				// The transmitter is double-buffered, so at this moment, it is transmitting
-				// the last byte of the frame. Wait until transfer is completed.
-				usart_disable_tx_interrupt(c->usart);
-				USART_CR1(c->usart) |= USART_CR1_TCIE;
-				c->state = STATE_TX_LAST;
-			}
+		if (status & (USART_SR_PE | USART_SR_FE | USART_SR_NE | USART_SR_ORE)) {
+			// Overrun also happens when the frame does not fit in the DMA buffer
+			if (!c->rx_bad)
+				c->rx_bad = (channel_rx_count(c) < sizeof(c->rx_buf)) ? RX_BAD_CHAR : RX_BAD_OVERSIZE;
+			// The frame is lost anyway, so do not interrupt again before IDLE
+			USART_CR1(c->usart) &= ~USART_CR1_PEIE;
+			USART_CR3(c->usart) &= ~USART_CR3_EIE;
+		}
+
+		if (status & USART_SR_IDLE) {
+			// Frames of known size end at channel_dma_rx_isr(), the rest (short, broken or unknown) here
+			(void) USART_DR(c->usart);	// Reading SR and then DR clears IDLE
+			c->rx_size = channel_rx_count(c);
+			if (!c->rx_size && !c->rx_bad)
+				return;
+
+			// IDLE means 1 character time of silence, but the frame ends after rx_char_timeout
+			timer_set_period(c->timer, c->rx_idle_delay);
+			timer_generate_event(c->timer, TIM_EGR_UG);
+			timer_enable_counter(c->timer);
 		}
-	} else if (c->state == STATE_TX_LAST) {
+	} else if (c->state == STATE_TX) {
 		if (status & USART_SR_TC) {
+			if (dma_get_number_of_data(DMA1, c->dma_tx)) {
+				// DMA did not keep up with the transmitter, the frame continues
+				USART_SR(c->usart) &= ~USART_SR_TC;
+				return;
+			}
 			// Transfer of the last byte is complete. Release the bus.
-			USART_CR1(c->usart) &= ~USART_CR1_TCIE;
 			channel_tx_done(c);
 			if (c->tx_buf[0])
 				channel_rx_init(c);
@@ -312,6 +424,35 @@ static void channel_usart_isr(struct channel *c)
 	}
 }
 
+static void channel_dma_rx_isr(struct channel *c)
+{
+	if (!dma_get_interrupt_flag(DMA1, c->dma_rx, DMA_TCIF))
+		return;
+	dma_clear_interrupt_flags(DMA1, c->dma_rx, DMA_TCIF);
+	if (c->state != STATE_RX)
+		return;
+
+	c->rx_size = channel_rx_count(c);
+	uint expected = channel_rx_expected_size(c);
+	if (c->rx_size == expected) {
+		if (c->rx_bad)
+			return;			// wait for IDLE, the slave may be still sending
+		/*
+		 *  The frame is complete, so we need not wait for the character
+		 *  timeout. The inter-frame gap is counted from the end of
+		 *  the transaction, so we pretend the timeout has passed.
+		 *  Anything the slave sends after the frame is ignored.
+		 */
+		channel_rx_done(c);
+		c->transaction_end_time += c->rx_char_timeout * MICROSECOND;
+	} else if (c->rx_size == RX_HEADER_SIZE) {
+		// Receive the rest of the frame. If we do not know its size, the whole buffer.
+		if (!expected || expected > sizeof(c->rx_buf))
+			expected = sizeof(c->rx_buf);
+		channel_rx_dma(c, RX_HEADER_SIZE, expected - RX_HEADER_SIZE);
+	}
+}
+
 void tim2_isr(void)
 {
 	channel_timer_isr(&channels[0]);
@@ -332,6 +473,16 @@ void usart3_isr(void)
 	channel_usart_isr(&channels[1]);
 }
 
+void dma1_channel5_isr(void)
+{
+	channel_dma_rx_isr(&channels[0]);
+}
+
+void dma1_channel3_isr(void)
+{
+	channel_dma_rx_isr(&channels[1]);
+}
+
 /*** CRC ***/
 
 static const byte crc_hi[] = {
@@ -448,10 +599,20 @@ static void channel_rx_frame(struct channel *c)
 #endif
 
 	if (!channel_check_rx(c)) {
+		if (c->retries_left) {
+			// Repeat the request right after the inter-frame gap
+			CDEBUG(c, "Msg #%04x: Retrying\n", c->current->msg.message_id);
+			c->retries_left--;
+			c->port_status->cnt_retries++;
+			c->port_state->last_transaction_end_time = c->transaction_end_time;
+			channel_tx_gap(c);
+			return;
+		}
 		internal_error_reply(c->current, MODBUS_ERR_GATEWAY_TARGET_DEVICE_FAILED);
 	} else {
 		struct urs485_message *m = &c->current->msg;
 		m->frame_size = c->rx_size - 2;
+		m->timing = c->rx_first_at - c->rx_start_at + 1;
 		memcpy(m->frame, c->rx_buf, m->frame_size);
 		CDEBUG(c, "Msg #%04x: Received %d bytes (time=%u)\n", m->message_id, c->rx_size, (uint) time_delta);
 		c->port_status->cnt_unicasts++;
@@ -468,6 +629,7 @@ static void channel_broadcast_done(struct channel *c)
 {
 	struct urs485_message *m = &c->current->msg;
 	m->frame_size = 2;
+	m->timing = 0;
 	m->frame[1] = 0;
 	CDEBUG(c, "Msg #%04x: Broadcast done\n", m->message_id);
 
@@ -484,7 +646,7 @@ static void channel_check_timeout(struct channel *c)
 	if (ms_ticks - c->rx_start_at <= c->rx_timeout)
 		return;
 
-	if (c->rx_size) {
+	if (channel_rx_count(c)) {
 		// If we are receiving a packet which is unlike line noise, continue
 		if (c->rx_bad != RX_BAD_OVERSIZE)
 			return;
@@ -501,10 +663,18 @@ static void channel_check_timeout(struct channel *c)
 
 static void channel_idle(struct channel *c)
 {
-	if (queue_is_empty(&c->send_queue))
+	/*
+	 *  Ports sharing a channel take turns, so that a port whose requests
+	 *  time out delays each of its siblings by at most one transaction.
+	 */
+	uint q = c->next_queue;
+	for (uint i=0; i<4 && queue_is_empty(&c->send_queue[q]); i++)
+		q = (q + 1) % 4;
+	if (queue_is_empty(&c->send_queue[q]))
 		return;
 
-	c->current = queue_get(&c->send_queue);
+	c->current = queue_get(&c->send_queue[q]);
+	c->next_queue = (q + 1) % 4;
 
 	struct urs485_message *m = &c->current->msg;
 	u16 crc = crc16(m->frame, m->frame_size);
@@ -513,6 +683,7 @@ static void channel_idle(struct channel *c)
 	CDEBUG(c, "Msg #%04x: Sending %d bytes to port %d\n", m->message_id, m->frame_size + 2, c->current->msg.port);
 
 	channel_activate_port(c, c->current->msg.port);
+	c->retries_left = c->port_state->params.retries;
 	channel_tx_gap(c);
 }
 
@@ -566,7 +737,7 @@ void got_msg_from_usb(struct message_node *n)
 	struct urs485_message *m = &n->msg;
 
 	if (m->port < 8 && m->frame_size >= 2 && m->frame_size <= 2 + MODBUS_MAX_DATA_SIZE)
-		queue_put(&channels[m->port / 4].send_queue, n);
+		queue_put(&channels[m->port / 4].send_queue[m->port % 4], n);
 	else
 		internal_error_reply(n, MODBUS_ERR_GATEWAY_PATH_UNAVAILABLE);
 }
@@ -580,6 +751,24 @@ static void channel_init(struct channel *c)
 	timer_one_shot_mode(c->timer);
 	timer_enable_irq(c->timer, TIM_DIER_UIE);
 
+	// DMA channels, memory address and size are set for each transfer
+	dma_channel_reset(DMA1, c->dma_tx);
+	dma_set_peripheral_address(DMA1, c->dma_tx, (u32) &USART_DR(c->usart));
+	dma_set_read_from_memory(DMA1, c->dma_tx);
+	dma_enable_memory_increment_mode(DMA1, c->dma_tx);
+	dma_set_peripheral_size(DMA1, c->dma_tx, DMA_CCR_PSIZE_8BIT);
+	dma_set_memory_size(DMA1, c->dma_tx, DMA_CCR_MSIZE_8BIT);
+	dma_set_priority(DMA1, c->dma_tx, DMA_CCR_PL_HIGH);
+
+	dma_channel_reset(DMA1, c->dma_rx);
+	dma_set_peripheral_address(DMA1, c->dma_rx, (u32) &USART_DR(c->usart));
+	dma_set_read_from_peripheral(DMA1, c->dma_rx);
+	dma_enable_memory_increment_mode(DMA1, c->dma_rx);
+	dma_set_peripheral_size(DMA1, c->dma_rx, DMA_CCR_PSIZE_8BIT);
+	dma_set_memory_size(DMA1, c->dma_rx, DMA_CCR_MSIZE_8BIT);
+	dma_set_priority(DMA1, c->dma_rx, DMA_CCR_PL_VERY_HIGH);
+	dma_enable_transfer_complete_interrupt(DMA1, c->dma_rx);
+
 	c->active_port = 0xff;
 	c->state = STATE_IDLE;
 }
@@ -592,8 +781,11 @@ void bus_init(void)
 	channels[0].id = 0;
 	channels[0].usart = USART1;
 	channels[0].timer = TIM2;
+	channels[0].dma_tx = DMA_CHANNEL4;
+	channels[0].dma_rx = DMA_CHANNEL5;
 	nvic_enable_irq(NVIC_USART1_IRQ);
 	nvic_enable_irq(NVIC_TIM2_IRQ);
+	nvic_enable_irq(NVIC_DMA1_CHANNEL5_IRQ);
 	channel_init(&channels[0]);
 
 	// Channel 1: USART3 (PB10 = TXD3, PB11 = RXD3)
@@ -602,7 +794,10 @@ void bus_init(void)
 	channels[1].id = 1;
 	channels[1].usart = USART3;
 	channels[1].timer = TIM3;
+	channels[1].dma_tx = DMA_CHANNEL2;
+	channels[1].dma_rx = DMA_CHANNEL3;
 	nvic_enable_irq(NVIC_USART3_IRQ);
 	nvic_enable_irq(NVIC_TIM3_IRQ);
+	nvic_enable_irq(NVIC_DMA1_CHANNEL3_IRQ);
 	channel_init(&channels[1]);
 }
@@ -8,6 +8,10 @@
 
 #define CPU_CLOCK_MHZ 72
 
+// Number of message buffers, reported to the host as the size of its send window
+
+#define MAX_IN_FLIGHT 4
+
 // Debugging port
 
 #define DEBUG_USART USART2
@@ -22,8 +22,6 @@ extern char serial_number[13];
 
 /*** Message queues (main.c) ***/
 
-#define MAX_IN_FLIGHT 4
-
 struct message_node {
 	struct message_node *next;
 	u32 usb_generation;
@@ -41,6 +39,7 @@ static inline bool queue_is_empty(struct message_queue *q)
 
 void queue_put(struct message_queue *q, struct message_node *n);
 struct message_node *queue_get(struct message_queue *q);
+void queue_remove(struct message_queue *q, struct message_node *n, struct message_node *prev);
 
 extern struct message_queue idle_queue;		// free message structures
 extern struct message_queue done_queue;		// to pass to the host
@@ -79,6 +78,7 @@ void bus_loop(void);
 
 bool set_port_params(uint port, struct urs485_port_params *par);
 void reset_port_stats(uint port);
+bool cancel_message(uint port, u16 message_id);
 
 void got_msg_from_usb(struct message_node *m);
 
@@ -6,7 +6,7 @@
 
 #define URS485_USB_VENDOR 0x4242
 #define URS485_USB_PRODUCT 0x000b
-#define URS485_USB_VERSION 0x0100
+#define URS485_USB_VERSION 0x0301
 
 /*
  *	Endpoints:
@@ -19,8 +19,37 @@
  *		(broadcast messages produce a synthetic reply with no data)
  *
  *	All structure fields are little-endian.
+ *
+ *	Protocol versions (reported in bcdDevice):
+ *
+ *	0x0100 = every bulk transfer carries a single message,
+ *		 window is opened by messages with port == 0xff
+ *
+ *	0x0200 = every bulk transfer carries a sequence of messages (see below),
+ *		 window is opened by credit messages with port == URS485_PORT_CREDIT
+ *
+ *	0x0300 = as 0x0200, but the message header contains the timing field
+ *		 (older versions have URS485_MSGHDR_SIZE_V2 bytes of header
+ *		 without it)
+ *
+ *	0x0301 = as 0x0300, but urs485_port_params contains retries
+ *		 (older versions accept it truncated before this field)
+ *		 and urs485_port_status contains cnt_retries
  */
 
+/*
+ *	Framing (version 0x0200):
+ *
+ *	Each bulk transfer in either direction carries one or more messages
+ *	stored back to back. Each message is a struct urs485_message truncated
+ *	after frame_size bytes of the frame. A transfer is at most
+ *	URS485_MAX_TRANSFER_SIZE bytes long and messages never cross
+ *	transfer boundaries. Replies are terminated by a short packet
+ *	(possibly of zero length) unless they fill the maximum size.
+ */
+
+#define URS485_MAX_TRANSFER_SIZE 1024
+
 /*
  *	Switch port numbering:
  *
@@ -33,15 +62,31 @@
  *	reported in the	urs485_config. However, when the client starts,
  *	some slots can be busy from the previous client. So the device
  *	opens up client's send window by sending synthetic replies marked
- *	by port == 0xff.
+ *	by port == 0xff (in version 0x0100), or credit messages marked by
+ *	port == URS485_PORT_CREDIT, which carry the number of slots granted
+ *	in message_id and have no frame (in version 0x0200). Every reply
+ *	returns one slot to the client, so the number of slots the client
+ *	holds plus the number of its messages in flight never exceeds
+ *	max_in_flight.
  */
 
+#define URS485_PORT_WINDOW_OPEN 0xff	// Version 0x0100 only
+#define URS485_PORT_CREDIT 0xfe
+
 #define MODBUS_MAX_DATA_SIZE 252
 
 struct urs485_message {
-	byte port;			// 0-7 (0xff for window open message)
+	byte port;			// 0-7 (or URS485_PORT_xxx)
 	byte frame_size;
 	u16 message_id;			// used to match replies with requests
+	/*
+	 *  In requests: timeout when waiting for reply in ms, 0 for the timeout
+	 *  of the port. Longer timeouts are clipped to the port's timeout.
+	 *
+	 *  In replies: time between the end of the request and the first
+	 *  byte of the reply in ms (rounded up), 0 for synthetic replies.
+	 */
+	u16 timing;
 	/*
 	 *  Internally, the frame has the following structure:
 	 *  	byte	slave_address;	// 0 for broadcast
@@ -55,6 +100,7 @@ struct urs485_message {
 };
 
 #define URS485_MSGHDR_SIZE offsetof(struct urs485_message, frame)
+#define URS485_MSGHDR_SIZE_V2 offsetof(struct urs485_message, timing)
 
 enum urs485_control_request {
 	URS485_CONTROL_GET_CONFIG,	// in: sends struct urs485_config
@@ -62,8 +108,15 @@ enum urs485_control_request {
 	URS485_CONTROL_GET_PORT_STATUS,	// in: sends struct urs485_port_status (wIndex=port number)
 	URS485_CONTROL_GET_POWER_STATUS,	// in: sends struct urs485_power_status
 	URS485_CONTROL_RESET_STATS,	// out: reset statistics (wIndex=port number)
+	URS485_CONTROL_CANCEL_MESSAGE,	// out: cancel a queued message (wIndex=port number, wValue=message ID)
 };
 
+/*
+ *	A cancelled message gets a reply with MODBUS_ERR_GATEWAY_PATH_UNAVAILABLE
+ *	as usual. If the message is already being transmitted (or its reply
+ *	was already sent), the request is stalled and the message proceeds.
+ */
+
 struct urs485_config {
 	u16 max_in_flight;		// maximum number of in-flight MODBUS messages
 };
@@ -73,6 +126,8 @@ struct urs485_port_params {
 	byte parity;			// URS485_PARITY_xxx
 	byte powered;			// 0=off, 1=on
 	u16 request_timeout;		// in milliseconds
+	byte retries;			// How many times to repeat a request whose reply is broken (0-5)
+	byte rfu[3];
 };
 
 enum urs485_parity {
@@ -92,6 +147,7 @@ struct urs485_port_status {
 	u32 cnt_crc_errors;		// Reply has incorrect CRC
 	u32 cnt_mismatch_errors;	// Reply does not match request
 	u32 cnt_timeouts;		// Did not receive reply in time
+	u32 cnt_retries;		// Requests repeated because of a broken reply
 };
 
 struct urs485_power_status {
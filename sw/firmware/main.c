@@ -65,6 +65,17 @@ struct message_node *queue_get(struct message_queue *q)
 	return n;
 }
 
+void queue_remove(struct message_queue *q, struct message_node *n, struct message_node *prev)
+{
+	// prev is the node before n, or NULL if n is the first one
+	if (prev)
+		prev->next = n->next;
+	else
+		q->first = n->next;
+	if (q->last == n)
+		q->last = prev;
+}
+
 static void queues_init(void)
 {
 	for (uint i=0; i < MAX_IN_FLIGHT; i++)
@@ -106,6 +117,7 @@ static void clock_init(void)
 	rcc_periph_clock_enable(RCC_SPI2);
 	rcc_periph_clock_enable(RCC_TIM2);
 	rcc_periph_clock_enable(RCC_TIM3);
+	rcc_periph_clock_enable(RCC_DMA1);
 	rcc_periph_clock_enable(RCC_ADC1);
 	rcc_periph_clock_enable(RCC_AFIO);
 
@@ -9,6 +9,7 @@
 #include <libopencm3/cm3/nvic.h>
 #include <libopencm3/cm3/scb.h>
 #include <libopencm3/stm32/gpio.h>
+#include <libopencm3/stm32/st_usbfs.h>
 #include <libopencm3/usb/dfu.h>
 #include <libopencm3/usb/usbd.h>
 
@@ -214,6 +215,14 @@ static enum usbd_request_return_codes control_cb(
 					return USBD_REQ_NOTSUPP;
 				reset_port_stats(index);
 				break;
+			case URS485_CONTROL_CANCEL_MESSAGE:
+				if (index >= 8)
+					return USBD_REQ_NOTSUPP;
+				if (*len != 0)
+					return USBD_REQ_NOTSUPP;
+				if (!cancel_message(index, req->wValue))
+					return USBD_REQ_NOTSUPP;
+				break;
 
 			default:
 				return USBD_REQ_NOTSUPP;
@@ -231,9 +240,14 @@ static struct message_node *usb_rx_msg;
 static uint usb_rx_pos;
 static byte usb_rx_buffer[64];
 
-static struct message_node *usb_tx_msg;
+static struct message_node *usb_tx_node;	// Message being sent or NULL for a credit message
+static struct urs485_message *usb_tx_msg;	// Its contents
 static uint usb_tx_pos;
-static bool usb_tx_in_flight;
+static uint usb_tx_xfer_len;			// Bytes already sent in the current transfer
+static byte usb_tx_packet[64];
+
+static uint usb_credits;			// Free slots not announced to the host yet
+static struct urs485_message usb_credit_msg;
 
 static void ep01_cb(usbd_device *dev, uint8_t ep UNUSED)
 {
@@ -274,44 +288,189 @@ static void ep01_cb(usbd_device *dev, uint8_t ep UNUSED)
 	}
 }
 
-static void ep82_kick(void)
+/*
+ *  The IN endpoint is double-buffered, which libopencm3 does not support,
+ *  so we program the USB peripheral directly.
+ *
+ *  The hardware sends from the buffer selected by DTOG_TX, the application
+ *  fills the buffer selected by SW_BUF (which is the DTOG_RX bit). When both
+ *  bits are equal, the endpoint NAKs. Whenever the hardware finishes sending
+ *  a buffer, it toggles DTOG_TX and triggers the high-priority interrupt,
+ *  where we release the other buffer if it has been filled in the meantime.
+ *  This way, the host can read packets back to back without waiting for
+ *  the main loop.
+ *
+ *  Buffers are filled only in the main loop, because message queues
+ *  are not interrupt-safe.
+ */
+
+#define EP82_NUM 2
+#define EP82_BUF1_ADDR 0x1c0		// Above everything allocated by libopencm3 for our endpoints
+#define EP82_KEEP_BITS (USB_EP_TYPE | USB_EP_KIND | USB_EP_ADDR)
+
+static volatile bool ep82_busy;		// The hardware owns one buffer
+static volatile bool ep82_pending;	// The other buffer is filled, waiting to be released
+
+static void ep82_toggle(u32 bits)
+{
+	// Writing 1 to CTR bits has no effect, toggle bits are flipped by writing 1
+	u32 r = *USB_EP_REG(EP82_NUM);
+	*USB_EP_REG(EP82_NUM) = (r & EP82_KEEP_BITS) | USB_EP_RX_CTR | USB_EP_TX_CTR | bits;
+}
+
+static void ep82_setup_double(void)
+{
+	u32 r = *USB_EP_REG(EP82_NUM);
+	*USB_EP_REG(EP82_NUM) = (r & EP82_KEEP_BITS) | USB_EP_KIND | USB_EP_RX_CTR | USB_EP_TX_CTR;
+
+	// The second buffer lives in the RX part of the buffer descriptor
+	*USB_EP_RX_ADDR(EP82_NUM) = EP82_BUF1_ADDR;
+	*USB_EP_RX_COUNT(EP82_NUM) = 0;
+	*USB_EP_TX_COUNT(EP82_NUM) = 0;
+
+	// Clear both buffer pointers and make the endpoint valid (NAK is implied by equal pointers)
+	r = *USB_EP_REG(EP82_NUM);
+	ep82_toggle((r & (USB_EP_TX_DTOG | USB_EP_RX_DTOG)) | ((r & USB_EP_TX_STAT) ^ USB_EP_TX_STAT_VALID));
+
+	ep82_busy = false;
+	ep82_pending = false;
+}
+
+static bool ep82_can_write(void)
+{
+	return !ep82_pending;
+}
+
+static void ep82_write_packet(const byte *buf, uint len)
+{
+	nvic_disable_irq(NVIC_USB_HP_CAN_TX_IRQ);
+
+	bool sw_buf = *USB_EP_REG(EP82_NUM) & USB_EP_RX_DTOG;
+	volatile u32 *addr_reg = sw_buf ? USB_EP_RX_ADDR(EP82_NUM) : USB_EP_TX_ADDR(EP82_NUM);
+	volatile u32 *count_reg = sw_buf ? USB_EP_RX_COUNT(EP82_NUM) : USB_EP_TX_COUNT(EP82_NUM);
+
+	// Packet memory is organized in 16-bit words on 32-bit boundaries
+	volatile u32 *pm = (volatile u32 *) (USB_PMA_BASE + 2 * (*addr_reg & 0xffff));
+	for (uint i=0; i < len; i += 2)
+		*pm++ = buf[i] | (buf[i+1] << 8);
+	*count_reg = len;
+
+	if (!ep82_busy) {
+		ep82_toggle(USB_EP_RX_DTOG);
+		ep82_busy = true;
+	} else {
+		ep82_pending = true;
+	}
+
+	nvic_enable_irq(NVIC_USB_HP_CAN_TX_IRQ);
+}
+
+void usb_hp_can_tx_isr(void)
 {
-	if (!usb_configured || usb_tx_in_flight)
+	u32 r = *USB_EP_REG(EP82_NUM);
+	if (!(r & USB_EP_TX_CTR))
 		return;
 
-	if (!usb_tx_msg) {
-		usb_tx_msg = queue_get(&done_queue);
-		if (!usb_tx_msg)
-			return;
-		struct urs485_message *m = &usb_tx_msg->msg;
-		if (usb_tx_msg->usb_generation == usb_generation) {
-			DEBUG("Sending message #%04x\n", m->message_id);
-		} else {
-			DEBUG("Flushing previous-generation message\n");
-			m->port = 0xff;
-			m->frame_size = 0;
-			m->message_id = 0;
-		}
+	// Clear CTR_TX
+	*USB_EP_REG(EP82_NUM) = (r & EP82_KEEP_BITS) | USB_EP_RX_CTR;
+
+	if (ep82_pending) {
+		ep82_toggle(USB_EP_RX_DTOG);
+		ep82_pending = false;
+	} else {
+		ep82_busy = false;
+	}
+}
+
+static bool ep82_next_msg(void)
+{
+	// Credit messages take precedence, so that the host can fill its window quickly
+	if (usb_credits) {
+		DEBUG("Granting %u credits\n", usb_credits);
+		usb_credit_msg.port = URS485_PORT_CREDIT;
+		usb_credit_msg.frame_size = 0;
+		usb_credit_msg.message_id = usb_credits;
+		usb_credits = 0;
+		usb_tx_node = NULL;
+		usb_tx_msg = &usb_credit_msg;
 		usb_tx_pos = 0;
+		return true;
+	}
+
+	struct message_node *n;
+	while (n = queue_get(&done_queue)) {
+		if (n->usb_generation == usb_generation) {
+			DEBUG("Sending message #%04x\n", n->msg.message_id);
+			usb_tx_node = n;
+			usb_tx_msg = &n->msg;
+			usb_tx_pos = 0;
+			return true;
+		}
+		DEBUG("Flushing previous-generation message\n");
+		queue_put(&idle_queue, n);
+		usb_credits++;
 	}
 
-	uint goal = URS485_MSGHDR_SIZE + usb_tx_msg->msg.frame_size;
-	uint len = MIN(goal - usb_tx_pos, 64);
-	usbd_ep_write_packet(usbd_dev, 0x82, (const byte *) &usb_tx_msg->msg + usb_tx_pos, len);
-	usb_tx_in_flight = true;
-	usb_tx_pos += len;
+	if (usb_credits)
+		return ep82_next_msg();
+
+	return false;
+}
 
-	if (usb_tx_pos == goal) {
-		DEBUG("Sent\n");
-		queue_put(&idle_queue, usb_tx_msg);
-		usb_tx_msg = NULL;
+static void ep82_kick(void)
+{
+	if (!usb_configured || !ep82_can_write())
+		return;
+
+	// Pack as many messages as possible to a single packet
+	uint len = 0;
+	while (len < sizeof(usb_tx_packet)) {
+		if (!usb_tx_msg) {
+			if (!ep82_next_msg())
+				break;
+		}
+
+		uint goal = URS485_MSGHDR_SIZE + usb_tx_msg->frame_size;
+		if (!usb_tx_pos && usb_tx_xfer_len + len + goal > URS485_MAX_TRANSFER_SIZE) {
+			// Message does not fit in the current transfer, so we end the transfer.
+			// As every message is shorter than the maximum transfer size, it will
+			// fit in the next one.
+			break;
+		}
+
+		uint n = MIN(goal - usb_tx_pos, sizeof(usb_tx_packet) - len);
+		memcpy(usb_tx_packet + len, (const byte *) usb_tx_msg + usb_tx_pos, n);
+		usb_tx_pos += n;
+		len += n;
+
+		if (usb_tx_pos == goal) {
+			DEBUG("Sent\n");
+			if (usb_tx_node)
+				queue_put(&idle_queue, usb_tx_node);
+			usb_tx_node = NULL;
+			usb_tx_msg = NULL;
+		}
+	}
+
+	if (!len && !usb_tx_xfer_len) {
+		// Nothing to send and no transfer to terminate
+		return;
 	}
+
+	/*
+	 *  A packet shorter than maximum (including an empty one) ends the transfer.
+	 *  The transfer also ends when it reaches the maximum size, since this is
+	 *  the size of the host's buffer.
+	 */
+	ep82_write_packet(usb_tx_packet, len);
+	usb_tx_xfer_len += len;
+	if (len < sizeof(usb_tx_packet) || usb_tx_xfer_len == URS485_MAX_TRANSFER_SIZE)
+		usb_tx_xfer_len = 0;
 }
 
 static void ep82_cb(usbd_device *dev UNUSED, uint8_t ep UNUSED)
 {
-	// We completed sending a frame to the USB host
-	usb_tx_in_flight = false;
+	// Normally handled by usb_hp_can_tx_isr(), but let us be safe
 	ep82_kick();
 }
 
@@ -331,25 +490,30 @@ static void set_config_cb(usbd_device *dev, uint16_t wValue UNUSED)
 		dfu_control_cb);
 	usbd_ep_setup(dev, 0x01, USB_ENDPOINT_ATTR_BULK, 64, ep01_cb);
 	usbd_ep_setup(dev, 0x82, USB_ENDPOINT_ATTR_BULK, 64, ep82_cb);
+	ep82_setup_double();
 	usb_configured = true;
 
-	// Increment USB generation and send all idle messages to the client,
-	// so that it can increase its send window.
+	// Increment USB generation and grant all idle messages to the client
+	// as credits. Messages of previous generations are turned to credits
+	// when they are done.
 	usb_generation++;
-	struct message_node *n;
-	while (n = queue_get(&idle_queue))
-		queue_put(&done_queue, n);
+	usb_credits = 0;
+	for (struct message_node *n = idle_queue.first; n; n = n->next)
+		usb_credits++;
 
 	// If there were in-progress transfers, cancel them
 	if (usb_rx_msg) {
-		queue_put(&done_queue, usb_rx_msg);
+		queue_put(&idle_queue, usb_rx_msg);
 		usb_rx_msg = NULL;
+		usb_credits++;
 	}
-	if (usb_tx_msg) {
-		queue_put(&done_queue, usb_tx_msg);
-		usb_tx_msg = NULL;
+	if (usb_tx_node) {
+		queue_put(&idle_queue, usb_tx_node);
+		usb_credits++;
 	}
-	usb_tx_in_flight = false;
+	usb_tx_node = NULL;
+	usb_tx_msg = NULL;
+	usb_tx_xfer_len = 0;
 }
 
 static void reset_cb(void)
@@ -367,8 +531,8 @@ void usb_lp_can_rx0_isr(void)
 	 *  USB interrupts and other code. However, we need an interrupt to
 	 *  up the main loop from sleep.
 	 *
-	 *  We set up only the low-priority ISR, because high-priority ISR handles
-	 *  only double-buffered bulk transfers and isochronous transfers.
+	 *  The high-priority ISR handles only double-buffered bulk transfers,
+	 *  see usb_hp_can_tx_isr().
 	 */
 	nvic_disable_irq(NVIC_USB_LP_CAN_RX0_IRQ);
 	usb_event_pending = 1;
@@ -394,6 +558,7 @@ void usb_init(void)
 	usbd_register_reset_callback(usbd_dev, reset_cb);
 	usbd_register_set_config_callback(usbd_dev, set_config_cb);
 	usb_event_pending = 1;
+	nvic_enable_irq(NVIC_USB_HP_CAN_TX_IRQ);
 }
 
 void usb_loop(void)
@@ -0,0 +1,2 @@
+// Emulated by the bus simulator
+#include "sim-hw.h"
@@ -0,0 +1,173 @@
+/*
+ *	USB-RS485 Switch Bus Simulator -- Emulated Peripherals
+ *
+ *	(c) 2022--2023 Martin Mares <mj@ucw.cz>
+ *
+ *	Only the parts of libopencm3 used by bus.c are provided. Registers
+ *	are plain variables, the behavior of the hardware is emulated by
+ *	sim.c once per simulated microsecond.
+ */
+
+#ifndef _SIM_HW_H
+#define _SIM_HW_H
+
+#include "util.h"
+
+/* NVIC and GPIO (ignored) */
+
+#define NVIC_USART1_IRQ 37
+#define NVIC_USART3_IRQ 39
+#define NVIC_TIM2_IRQ 28
+#define NVIC_TIM3_IRQ 29
+#define NVIC_DMA1_CHANNEL3_IRQ 13
+#define NVIC_DMA1_CHANNEL5_IRQ 15
+
+#define GPIOA 0
+#define GPIOB 1
+#define GPIO9 (1 << 9)
+#define GPIO10 (1 << 10)
+#define GPIO11 (1 << 11)
+#define GPIO_MODE_INPUT 0
+#define GPIO_MODE_OUTPUT_50_MHZ 3
+#define GPIO_CNF_INPUT_FLOAT 1
+#define GPIO_CNF_OUTPUT_ALTFN_PUSHPULL 2
+
+static inline void nvic_enable_irq(uint irq UNUSED) { }
+static inline void gpio_set_mode(u32 port UNUSED, u32 mode UNUSED, u32 cnf UNUSED, u32 pins UNUSED) { }
+
+/* USART (USART1 and USART3 are indices to sim_usart[]) */
+
+#define USART1 0
+#define USART3 1
+
+struct sim_usart {
+	u32 sr, cr1, cr3, dr;
+	u32 baud_rate;
+	u32 mode;
+};
+
+extern struct sim_usart sim_usart[2];
+u32 *sim_usart_dr(u32 usart);
+
+#define USART_SR(u) (sim_usart[u].sr)
+#define USART_CR1(u) (sim_usart[u].cr1)
+#define USART_CR3(u) (sim_usart[u].cr3)
+#define USART_DR(u) (*sim_usart_dr(u))	// Reading DR clears IDLE and errors
+
+#define USART_SR_PE (1 << 0)
+#define USART_SR_FE (1 << 1)
+#define USART_SR_NE (1 << 2)
+#define USART_SR_ORE (1 << 3)
+#define USART_SR_IDLE (1 << 4)
+#define USART_SR_RXNE (1 << 5)
+#define USART_SR_TC (1 << 6)
+#define USART_SR_TXE (1 << 7)
+
+#define USART_CR1_IDLEIE (1 << 4)
+#define USART_CR1_RXNEIE (1 << 5)
+#define USART_CR1_TCIE (1 << 6)
+#define USART_CR1_TXEIE (1 << 7)
+#define USART_CR1_PEIE (1 << 8)
+
+#define USART_CR3_EIE (1 << 0)
+#define USART_CR3_DMAR (1 << 6)
+#define USART_CR3_DMAT (1 << 7)
+
+#define USART_MODE_RX 4
+#define USART_MODE_TX 8
+#define USART_PARITY_NONE 0
+#define USART_PARITY_EVEN 1
+#define USART_PARITY_ODD 2
+#define USART_STOPBITS_1 0
+#define USART_STOPBITS_2 2
+#define USART_FLOWCONTROL_NONE 0
+
+static inline void usart_set_baudrate(u32 usart, u32 baud) { sim_usart[usart].baud_rate = baud; }
+static inline void usart_set_databits(u32 usart UNUSED, u32 bits UNUSED) { }
+static inline void usart_set_stopbits(u32 usart UNUSED, u32 bits UNUSED) { }
+static inline void usart_set_parity(u32 usart UNUSED, u32 parity UNUSED) { }
+static inline void usart_set_flow_control(u32 usart UNUSED, u32 fc UNUSED) { }
+static inline void usart_set_mode(u32 usart, u32 mode) { sim_usart[usart].mode = mode; }
+static inline void usart_enable(u32 usart UNUSED) { }
+static inline void usart_disable(u32 usart UNUSED) { }
+static inline void usart_disable_rx_interrupt(u32 usart) { sim_usart[usart].cr1 &= ~USART_CR1_RXNEIE; }
+static inline void usart_enable_rx_dma(u32 usart) { sim_usart[usart].cr3 |= USART_CR3_DMAR; }
+static inline void usart_disable_rx_dma(u32 usart) { sim_usart[usart].cr3 &= ~USART_CR3_DMAR; }
+static inline void usart_enable_tx_dma(u32 usart) { sim_usart[usart].cr3 |= USART_CR3_DMAT; }
+static inline void usart_disable_tx_dma(u32 usart) { sim_usart[usart].cr3 &= ~USART_CR3_DMAT; }
+
+/* Timers (TIM2 and TIM3 are indices to sim_timer[], 1 tick = 1 μs) */
+
+#define TIM2 0
+#define TIM3 1
+
+struct sim_timer {
+	u32 sr;
+	u32 period;
+	u32 counter;
+	bool running;
+};
+
+extern struct sim_timer sim_timer[2];
+
+#define TIM_SR(t) (sim_timer[t].sr)
+#define TIM_SR_UIF (1 << 0)
+#define TIM_EGR_UG (1 << 0)
+#define TIM_DIER_UIE (1 << 0)
+#define TIM_CR1_CKD_CK_INT 0
+#define TIM_CR1_CMS_EDGE 0
+#define TIM_CR1_DIR_DOWN 0
+
+static inline void timer_set_prescaler(u32 t UNUSED, u32 p UNUSED) { }
+static inline void timer_set_mode(u32 t UNUSED, u32 a UNUSED, u32 b UNUSED, u32 c UNUSED) { }
+static inline void timer_update_on_overflow(u32 t UNUSED) { }
+static inline void timer_disable_preload(u32 t UNUSED) { }
+static inline void timer_one_shot_mode(u32 t UNUSED) { }
+static inline void timer_enable_irq(u32 t UNUSED, u32 irq UNUSED) { }
+static inline void timer_set_period(u32 t, u32 period) { sim_timer[t].period = period; }
+static inline void timer_generate_event(u32 t, u32 ev UNUSED) { sim_timer[t].counter = sim_timer[t].period; }
+static inline void timer_enable_counter(u32 t) { sim_timer[t].running = true; }
+static inline void timer_disable_counter(u32 t) { sim_timer[t].running = false; }
+
+/* DMA1 (memory addresses are truncated to 32 bits, sim.c uses them as offsets to the buffers of channels) */
+
+#define DMA1 0
+#define DMA_CHANNEL2 2
+#define DMA_CHANNEL3 3
+#define DMA_CHANNEL4 4
+#define DMA_CHANNEL5 5
+#define DMA_CCR_MSIZE_8BIT 0
+#define DMA_CCR_PSIZE_8BIT 0
+#define DMA_CCR_PL_HIGH 2
+#define DMA_CCR_PL_VERY_HIGH 3
+#define DMA_TCIF (1 << 1)
+
+struct sim_dma {
+	bool enabled;
+	bool tcie;			// transfer complete interrupt enabled
+	u32 addr;
+	u32 size;			// number of data at the start of the transfer
+	u32 count;
+	u32 flags;			// DMA_xxIF
+};
+
+extern struct sim_dma sim_dma[8];
+
+static inline void dma_channel_reset(u32 dma UNUSED, u8 ch) { sim_dma[ch] = (struct sim_dma) { 0 }; }
+static inline void dma_set_peripheral_address(u32 dma UNUSED, u8 ch UNUSED, u32 addr UNUSED) { }
+static inline void dma_set_memory_address(u32 dma UNUSED, u8 ch, u32 addr) { sim_dma[ch].addr = addr; }
+static inline void dma_set_read_from_memory(u32 dma UNUSED, u8 ch UNUSED) { }
+static inline void dma_set_read_from_peripheral(u32 dma UNUSED, u8 ch UNUSED) { }
+static inline void dma_enable_memory_increment_mode(u32 dma UNUSED, u8 ch UNUSED) { }
+static inline void dma_set_peripheral_size(u32 dma UNUSED, u8 ch UNUSED, u32 size UNUSED) { }
+static inline void dma_set_memory_size(u32 dma UNUSED, u8 ch UNUSED, u32 size UNUSED) { }
+static inline void dma_set_priority(u32 dma UNUSED, u8 ch UNUSED, u32 prio UNUSED) { }
+static inline void dma_set_number_of_data(u32 dma UNUSED, u8 ch, u16 n) { sim_dma[ch].size = sim_dma[ch].count = n; }
+static inline u16 dma_get_number_of_data(u32 dma UNUSED, u8 ch) { return sim_dma[ch].count; }
+static inline void dma_enable_channel(u32 dma UNUSED, u8 ch) { sim_dma[ch].enabled = true; }
+static inline void dma_disable_channel(u32 dma UNUSED, u8 ch) { sim_dma[ch].enabled = false; }
+static inline void dma_enable_transfer_complete_interrupt(u32 dma UNUSED, u8 ch) { sim_dma[ch].tcie = true; }
+static inline bool dma_get_interrupt_flag(u32 dma UNUSED, u8 ch, u32 flags) { return sim_dma[ch].flags & flags; }
+static inline void dma_clear_interrupt_flags(u32 dma UNUSED, u8 ch, u32 flags) { sim_dma[ch].flags &= ~flags; }
+
+#endif
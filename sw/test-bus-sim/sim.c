@@ -0,0 +1,689 @@
+/*
+ *	USB-RS485 Switch Bus Simulator
+ *
+ *	(c) 2022--2023 Martin Mares <mj@ucw.cz>
+ *
+ *	The real bus.c of the firmware is compiled on the host against
+ *	emulated USART, timer and DMA peripherals (see sim-hw.h). Time runs
+ *	in steps of 1 μs. Slaves answer after a fixed delay, dead slaves
+ *	never answer. The host submits requests to the ports of each scenario
+ *	as described below.
+ */
+
+#include "bus.c"
+
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*** Replacements of main.c ***/
+
+volatile u32 ms_ticks;
+static u64 now_us;
+
+u32 get_current_time(void)
+{
+	return now_us * MICROSECOND;
+}
+
+void retry_loop(void)
+{
+}
+
+void debug_printf(const char *fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	printf("%10.3f ms: ", now_us / 1000.);
+	vprintf(fmt, args);
+	va_end(args);
+}
+
+static struct message_node message_buf[MAX_IN_FLIGHT];
+
+struct message_queue idle_queue;
+struct message_queue done_queue;
+
+void queue_put(struct message_queue *q, struct message_node *n)
+{
+	if (q->last)
+		q->last->next = n;
+	else
+		q->first = n;
+	q->last = n;
+	n->next = NULL;
+}
+
+struct message_node *queue_get(struct message_queue *q)
+{
+	struct message_node *n = q->first;
+	if (n) {
+		q->first = n->next;
+		if (!q->first)
+			q->last = NULL;
+	}
+	return n;
+}
+
+void queue_remove(struct message_queue *q, struct message_node *n, struct message_node *prev)
+{
+	if (prev)
+		prev->next = n->next;
+	else
+		q->first = n->next;
+	if (q->last == n)
+		q->last = prev;
+}
+
+struct port_state ports[8];
+
+void reg_send(void) { }
+void reg_set_flag(uint port UNUSED, uint flag UNUSED) { }
+void reg_clear_flag(uint port UNUSED, uint flag UNUSED) { }
+void reg_toggle_flag(uint port UNUSED, uint flag UNUSED) { }
+
+/*** Peripherals ***/
+
+struct sim_usart sim_usart[2];
+struct sim_timer sim_timer[2];
+struct sim_dma sim_dma[8];
+
+u32 *sim_usart_dr(u32 usart)
+{
+	// Reading SR followed by DR clears IDLE and error flags
+	sim_usart[usart].sr &= ~(USART_SR_IDLE | USART_SR_ORE | USART_SR_PE | USART_SR_FE | USART_SR_NE);
+	return &sim_usart[usart].dr;
+}
+
+static void sim_usart_isr(uint usart)
+{
+	if (usart == USART1)
+		usart1_isr();
+	else
+		usart3_isr();
+}
+
+static void sim_dma_rx_isr(uint ch)
+{
+	if (ch == DMA_CHANNEL5)
+		dma1_channel5_isr();
+	else
+		dma1_channel3_isr();
+}
+
+static void sim_timer_step(uint t)
+{
+	struct sim_timer *tm = &sim_timer[t];
+	if (!tm->running)
+		return;
+	if (tm->counter > 1) {
+		tm->counter--;
+		return;
+	}
+
+	// One-shot mode: the counter stops at update event
+	tm->running = false;
+	tm->sr |= TIM_SR_UIF;
+	if (t == TIM2)
+		tim2_isr();
+	else
+		tim3_isr();
+}
+
+/*** Slaves and the RS485 line ***/
+
+struct sim_slave {
+	bool dead;			// never replies
+	u32 delay;			// μs between the request and the reply
+	// The RS485 bus of the port
+	double wire_end;		// when the last character on the bus ended
+	double min_gap;			// shortest silence before a request
+};
+
+static struct sim_slave slaves[8];
+
+struct sim_line {
+	// Request being transmitted
+	bool tx_busy;
+	double tx_next_at;
+	byte req[256];
+	uint req_len;
+	// Reply being received
+	byte reply[256];
+	uint reply_len, reply_pos;
+	double reply_next_at;
+	double idle_at;			// when USART detects idle line, 0 if not pending
+};
+
+static struct sim_line lines[2];
+
+static double char_time(uint usart)
+{
+	return 11e6 / sim_usart[usart].baud_rate;
+}
+
+static void slave_request(struct channel *c, struct sim_line *l)
+{
+	struct sim_slave *s = &slaves[c->active_port];
+	byte *req = l->req;
+	byte *r = l->reply;
+	uint len;
+
+	if (s->dead || l->req_len < 4 || !req[0])
+		return;
+
+	switch (req[1]) {
+		case MODBUS_FUNC_READ_HOLDING_REGISTERS:
+		case MODBUS_FUNC_READ_INPUT_REGISTERS: {
+			uint regs = req[5];
+			r[2] = 2*regs;
+			for (uint i=0; i < 2*regs; i++)
+				r[3+i] = i;
+			len = 3 + 2*regs;
+			break;
+		}
+		case MODBUS_FUNC_REPORT_SLAVE_ID: {
+			static const char id[] = "Simulated slave";
+			r[2] = sizeof(id);
+			memcpy(r+3, id, sizeof(id));
+			len = 3 + sizeof(id);
+			break;
+		}
+		default:
+			r[2] = MODBUS_ERR_ILLEGAL_FUNCTION;
+			len = 3;
+	}
+	r[0] = req[0];
+	r[1] = (len == 3) ? req[1] | 0x80 : req[1];
+
+	u16 crc = crc16(r, len);
+	r[len++] = crc >> 8;
+	r[len++] = crc;
+
+	l->reply_len = len;
+	l->reply_pos = 0;
+	l->reply_next_at = now_us + s->delay + char_time(c->usart);
+}
+
+static void sim_line_step(struct channel *c, struct sim_line *l)
+{
+	struct sim_usart *u = &sim_usart[c->usart];
+	struct sim_dma *tx = &sim_dma[c->dma_tx];
+	struct sim_dma *rx = &sim_dma[c->dma_rx];
+
+	// Transmitter fed by DMA, TC is set when the last character leaves
+	if ((u->mode & USART_MODE_TX) && (u->cr3 & USART_CR3_DMAT) && tx->enabled && tx->count) {
+		struct sim_slave *s = &slaves[c->active_port];
+		if (!l->tx_busy) {
+			l->tx_busy = true;
+			l->tx_next_at = now_us + char_time(c->usart);
+			l->req_len = 0;
+			if (s->wire_end && now_us - s->wire_end < s->min_gap)
+				s->min_gap = now_us - s->wire_end;
+		}
+		if (now_us >= l->tx_next_at) {
+			l->req[l->req_len++] = c->tx_buf[c->tx_size - tx->count];
+			s->wire_end = l->tx_next_at;
+			l->tx_next_at += char_time(c->usart);
+			if (!--tx->count) {
+				l->tx_busy = false;
+				slave_request(c, l);
+				u->sr |= USART_SR_TC;
+				if (u->cr1 & USART_CR1_TCIE)
+					sim_usart_isr(c->usart);
+			}
+		}
+	}
+
+	// Receiver: characters are stored by DMA, which overruns when the buffer is full
+	if (l->reply_pos < l->reply_len && now_us >= l->reply_next_at) {
+		bool receiving = (u->mode & USART_MODE_RX);
+		if (receiving && (u->cr3 & USART_CR3_DMAR) && rx->enabled && rx->count) {
+			c->rx_buf[rx->addr - (u32) c->rx_buf + rx->size - rx->count] = l->reply[l->reply_pos];
+			if (!--rx->count) {
+				rx->flags |= DMA_TCIF;
+				if (rx->tcie)
+					sim_dma_rx_isr(c->dma_rx);
+			}
+			if (u->cr1 & USART_CR1_RXNEIE) {
+				u->sr |= USART_SR_RXNE;
+				sim_usart_isr(c->usart);
+				u->sr &= ~USART_SR_RXNE;
+			}
+		} else if (receiving) {
+			u->sr |= USART_SR_ORE;
+			if (u->cr3 & USART_CR3_EIE)
+				sim_usart_isr(c->usart);
+		}
+		l->reply_pos++;
+		slaves[c->active_port].wire_end = l->reply_next_at;
+		l->reply_next_at += char_time(c->usart);
+		if (l->reply_pos == l->reply_len)
+			l->idle_at = l->reply_next_at;
+	}
+
+	if (l->idle_at && now_us >= l->idle_at) {
+		l->idle_at = 0;
+		if (u->mode & USART_MODE_RX) {
+			u->sr |= USART_SR_IDLE;
+			if (u->cr1 & USART_CR1_IDLEIE)
+				sim_usart_isr(c->usart);
+		}
+	}
+}
+
+/*** Host ***/
+
+/*
+ *  Either the host keeps each port busy with a fixed number of requests
+ *  (closed loop), or requests arrive at random with a given rate and wait
+ *  in per-port queues until the scheduler passes them to the switch. The
+ *  schedulers mirror sched_pick_fair() and sched_pick_edf() of the daemon.
+ */
+
+enum sim_sched {
+	SIM_CLOSED_LOOP,		// round-robin over ports, at most depth requests per port
+	SIM_FAIR,			// balance channels, then ports
+	SIM_EDF,			// earliest deadline first
+};
+
+#define MAX_PENDING 4096
+
+struct sim_port {
+	// Configuration
+	bool active;			// host sends requests to this port
+	uint depth;			// closed loop: maximum number of requests at the switch
+	double rate;			// open loop: requests per second
+	byte func;			// function code of requests
+	byte regs;			// number of registers to read
+	// State
+	uint in_flight;
+	double next_arrival;
+	u64 pending[MAX_PENDING];	// arrival times of requests waiting in the host
+	uint pending_head, pending_count;
+	u64 avg_reply_time;		// as learned by the EDF scheduler
+	// Statistics
+	uint replies;
+	uint errors;
+	uint overflows;			// arrivals which did not fit in pending[]
+	u32 *latencies;			// μs between arrival and reply
+	uint num_latencies, max_latencies;
+	double eof_sum;			// μs between the end of reply on the bus and its completion
+};
+
+static struct sim_port sim_ports[8];
+static enum sim_sched host_sched;
+static uint host_next_port;
+static uint host_next_channel;
+static uint host_channel_next_port[2];
+static u16 host_next_id;
+static u64 rng_state;
+
+struct host_msg {
+	u64 arrival_time;
+	u64 sent_time;
+	u64 expected_duration;
+};
+
+static u64 host_channel_backlog[2];	// sum of expected durations of requests in flight
+
+static struct host_msg host_msgs[MAX_IN_FLIGHT];
+
+static double host_random_interval(double rate)
+{
+	// Exponentially distributed interval between arrivals [μs]
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	double u = (rng_state >> 11) * (1. / (1ULL << 53));
+	return -log(1 - u) / rate * 1e6;
+}
+
+static uint host_frame_size(struct sim_port *sp)
+{
+	return (sp->func == MODBUS_FUNC_REPORT_SLAVE_ID) ? 2 : 6;
+}
+
+static u64 host_wire_time(uint p)
+{
+	// Time needed to transmit the request (as in sched_wire_time())
+	return (u64) (host_frame_size(&sim_ports[p]) + 2) * 11 * 1000000 / ports[p].params.baud_rate;
+}
+
+static u64 host_expected_duration(uint p)
+{
+	u64 wire = host_wire_time(p);
+	return wire + (sim_ports[p].avg_reply_time ? : wire);
+}
+
+static uint host_channel_in_flight(uint c)
+{
+	uint n = 0;
+	for (uint p = 4*c; p < 4*c + 4; p++)
+		n += sim_ports[p].in_flight;
+	return n;
+}
+
+static int host_pick_closed_loop(void)
+{
+	uint p = host_next_port;
+	for (uint i=0; i<8; i++) {
+		struct sim_port *sp = &sim_ports[p];
+		if (sp->active && sp->in_flight < sp->depth) {
+			host_next_port = (p + 1) % 8;
+			return p;
+		}
+		p = (p + 1) % 8;
+	}
+	return -1;
+}
+
+static int host_pick_fair(void)
+{
+	int best = -1;
+	uint best_in_flight = ~0U;
+
+	for (uint i=0; i<2; i++) {
+		uint c = (host_next_channel + i) % 2;
+		if (host_channel_in_flight(c) >= best_in_flight)
+			continue;
+		int best_port = -1;
+		uint best_port_in_flight = ~0U;
+		for (uint j=0; j<4; j++) {
+			uint p = 4*c + (host_channel_next_port[c] + j) % 4;
+			if (sim_ports[p].pending_count && sim_ports[p].in_flight < best_port_in_flight) {
+				best_port = p;
+				best_port_in_flight = sim_ports[p].in_flight;
+			}
+		}
+		if (best_port >= 0) {
+			best = best_port;
+			best_in_flight = host_channel_in_flight(c);
+		}
+	}
+
+	return best;
+}
+
+static int host_pick_edf(void)
+{
+	int best = -1;
+	u64 best_deadline = ~0ULL;
+
+	for (uint p=0; p<8; p++) {
+		struct sim_port *sp = &sim_ports[p];
+		if (!sp->pending_count)
+			continue;
+		u64 deadline = sp->pending[sp->pending_head] + host_channel_backlog[p/4] + host_expected_duration(p);
+		if (deadline < best_deadline ||
+		    deadline == best_deadline && host_channel_in_flight(p/4) < host_channel_in_flight(best/4)) {
+			best = p;
+			best_deadline = deadline;
+		}
+	}
+
+	return best;
+}
+
+static void host_arrivals(void)
+{
+	for (uint p=0; p<8; p++) {
+		struct sim_port *sp = &sim_ports[p];
+		if (!sp->active)
+			continue;
+		while (sp->next_arrival <= now_us) {
+			if (sp->pending_count < MAX_PENDING) {
+				sp->pending[(sp->pending_head + sp->pending_count) % MAX_PENDING] = now_us;
+				sp->pending_count++;
+			} else
+				sp->overflows++;
+			sp->next_arrival += host_random_interval(sp->rate);
+		}
+	}
+}
+
+static void host_submit(void)
+{
+	if (host_sched != SIM_CLOSED_LOOP)
+		host_arrivals();
+
+	while (!queue_is_empty(&idle_queue)) {
+		int p;
+		switch (host_sched) {
+			case SIM_FAIR:
+				p = host_pick_fair();
+				break;
+			case SIM_EDF:
+				p = host_pick_edf();
+				break;
+			default:
+				p = host_pick_closed_loop();
+		}
+		if (p < 0)
+			return;
+		host_next_channel = (p/4 + 1) % 2;
+		host_channel_next_port[p/4] = (p%4 + 1) % 4;
+
+		struct sim_port *sp = &sim_ports[p];
+		struct message_node *n = queue_get(&idle_queue);
+		struct host_msg *hm = &host_msgs[n - message_buf];
+		if (host_sched != SIM_CLOSED_LOOP) {
+			hm->arrival_time = sp->pending[sp->pending_head];
+			sp->pending_head = (sp->pending_head + 1) % MAX_PENDING;
+			sp->pending_count--;
+		} else
+			hm->arrival_time = now_us;
+		hm->sent_time = now_us;
+		hm->expected_duration = host_expected_duration(p);
+		host_channel_backlog[p/4] += hm->expected_duration;
+
+		struct urs485_message *m = &n->msg;
+		m->port = p;
+		m->message_id = host_next_id++;
+		m->timing = 0;
+		m->frame[0] = 1;
+		m->frame[1] = sp->func;
+		m->frame[2] = 0;
+		m->frame[3] = 0;
+		m->frame[4] = 0;
+		m->frame[5] = sp->regs;
+		m->frame_size = host_frame_size(sp);
+		sp->in_flight++;
+		got_msg_from_usb(n);
+	}
+}
+
+static void host_receive(void)
+{
+	struct message_node *n;
+	while (n = queue_get(&done_queue)) {
+		struct urs485_message *m = &n->msg;
+		struct host_msg *hm = &host_msgs[n - message_buf];
+		struct sim_port *sp = &sim_ports[m->port];
+
+		if (m->frame_size >= 2 && !(m->frame[1] & 0x80)) {
+			sp->replies++;
+			sp->eof_sum += now_us - slaves[m->port].wire_end;
+			// Learn how long the device takes to reply (as in sched_msg_done())
+			s64 sample = now_us - hm->sent_time - host_wire_time(m->port);
+			sample = MAX(sample, 1);
+			if (sp->avg_reply_time)
+				sp->avg_reply_time += (sample - (s64) sp->avg_reply_time) / 8;
+			else
+				sp->avg_reply_time = sample;
+		} else
+			sp->errors++;
+
+		if (sp->num_latencies >= sp->max_latencies) {
+			sp->max_latencies = MAX(2 * sp->max_latencies, 1024);
+			sp->latencies = realloc(sp->latencies, sp->max_latencies * sizeof(u32));
+		}
+		sp->latencies[sp->num_latencies++] = now_us - hm->arrival_time;
+
+		sp->in_flight--;
+		host_channel_backlog[m->port/4] -= hm->expected_duration;
+		queue_put(&idle_queue, n);
+	}
+}
+
+/*** Scenarios ***/
+
+struct sim_load {
+	byte port;
+	u32 baud_rate;
+	byte regs;
+	double rate;			// requests per second, 0 terminates the list
+};
+
+struct scenario {
+	const char *name;
+	enum sim_sched sched;
+	u32 baud_rate;			// of all ports not mentioned in load
+	byte active_mask;		// closed loop: active ports
+	byte dead_mask;
+	byte greedy_mask;		// closed loop: ports whose client keeps all buffers busy if it can
+	byte func;
+	const struct sim_load *load;	// open loop: load of individual ports
+	bool timing;			// show timing of frames
+};
+
+// A slow port with long replies and fast ports with short ones
+static const struct sim_load mixed_load[] = {
+	{ 0,   1200, 10,  1.5 },
+	{ 1, 115200,  2, 20 },
+	{ 4, 115200,  2, 40 },
+	{ 5, 115200,  2, 40 },
+	{ 0 }
+};
+
+static const struct scenario scenarios[] = {
+	{ "Ports 0-3 healthy",				SIM_CLOSED_LOOP, 19200, 0x0f, 0x00, 0x00, MODBUS_FUNC_READ_HOLDING_REGISTERS, NULL, false },
+	{ "Port 0 dead",				SIM_CLOSED_LOOP, 19200, 0x0f, 0x01, 0x00, MODBUS_FUNC_READ_HOLDING_REGISTERS, NULL, false },
+	{ "Port 4 (other channel) dead",		SIM_CLOSED_LOOP, 19200, 0x1f, 0x10, 0x00, MODBUS_FUNC_READ_HOLDING_REGISTERS, NULL, false },
+	{ "Port 4 (other channel) dead, its client greedy", SIM_CLOSED_LOOP, 19200, 0x1f, 0x10, 0x10, MODBUS_FUNC_READ_HOLDING_REGISTERS, NULL, false },
+	{ "Ports 0-2 healthy",				SIM_CLOSED_LOOP, 19200, 0x07, 0x00, 0x00, MODBUS_FUNC_READ_HOLDING_REGISTERS, NULL, false },
+	{ "Port 0 dead, its client greedy",		SIM_CLOSED_LOOP, 19200, 0x07, 0x01, 0x01, MODBUS_FUNC_READ_HOLDING_REGISTERS, NULL, false },
+	{ "Mixed load, fair scheduler",			SIM_FAIR, 19200, 0, 0, 0, MODBUS_FUNC_READ_HOLDING_REGISTERS, mixed_load, false },
+	{ "Mixed load, EDF scheduler",			SIM_EDF, 19200, 0, 0, 0, MODBUS_FUNC_READ_HOLDING_REGISTERS, mixed_load, false },
+	{ "Reply of known length",			SIM_CLOSED_LOOP, 19200, 0x01, 0x00, 0x00, MODBUS_FUNC_READ_HOLDING_REGISTERS, NULL, true },
+	{ "Reply of unknown length",			SIM_CLOSED_LOOP, 19200, 0x01, 0x00, 0x00, MODBUS_FUNC_REPORT_SLAVE_ID, NULL, true },
+};
+
+static uint sim_seconds = 60;
+static u16 sim_timeout = 100;
+static u32 sim_delay = 5000;
+
+static int cmp_u32(const void *a, const void *b)
+{
+	u32 x = *(const u32 *) a, y = *(const u32 *) b;
+	return (x > y) - (x < y);
+}
+
+static double percentile(struct sim_port *sp, uint pct)
+{
+	if (!sp->num_latencies)
+		return 0;
+	return sp->latencies[(u64) (sp->num_latencies - 1) * pct / 100] / 1000.;
+}
+
+static void run_scenario(const struct scenario *s)
+{
+	memset(channels, 0, sizeof(channels));
+	memset(sim_usart, 0, sizeof(sim_usart));
+	memset(sim_timer, 0, sizeof(sim_timer));
+	memset(sim_dma, 0, sizeof(sim_dma));
+	memset(lines, 0, sizeof(lines));
+	memset(ports, 0, sizeof(ports));
+	for (uint p=0; p<8; p++)
+		free(sim_ports[p].latencies);
+	memset(sim_ports, 0, sizeof(sim_ports));
+	idle_queue.first = idle_queue.last = NULL;
+	done_queue.first = done_queue.last = NULL;
+	now_us = 0;
+	ms_ticks = 0;
+	host_sched = s->sched;
+	host_next_port = host_next_channel = 0;
+	host_channel_next_port[0] = host_channel_next_port[1] = 0;
+	host_channel_backlog[0] = host_channel_backlog[1] = 0;
+	rng_state = 0x2545f4914f6cdd1d;
+
+	for (uint i=0; i < MAX_IN_FLIGHT; i++)
+		queue_put(&idle_queue, &message_buf[i]);
+	bus_init();
+
+	for (uint p=0; p<8; p++) {
+		struct sim_port *sp = &sim_ports[p];
+		u32 baud_rate = s->baud_rate;
+		sp->active = s->active_mask & (1U << p);
+		sp->depth = (s->greedy_mask & (1U << p)) ? MAX_IN_FLIGHT : 1;
+		sp->func = s->func;
+		sp->regs = 10;
+		for (const struct sim_load *l = s->load; l && l->rate; l++)
+			if (l->port == p) {
+				sp->active = true;
+				sp->rate = l->rate;
+				sp->regs = l->regs;
+				sp->next_arrival = host_random_interval(l->rate);
+				baud_rate = l->baud_rate;
+			}
+
+		struct urs485_port_params par = {
+			.baud_rate = baud_rate,
+			.parity = URS485_PARITY_EVEN,
+			.request_timeout = sim_timeout,
+		};
+		set_port_params(p, &par);
+		slaves[p].dead = s->dead_mask & (1U << p);
+		slaves[p].delay = sim_delay;
+		slaves[p].wire_end = 0;
+		slaves[p].min_gap = 1e9;
+	}
+
+	u64 end = (u64) sim_seconds * 1000000;
+	while (now_us < end) {
+		now_us++;
+		ms_ticks = now_us / 1000;
+		for (uint i=0; i<2; i++) {
+			sim_line_step(&channels[i], &lines[i]);
+			sim_timer_step(channels[i].timer);
+		}
+		bus_loop();
+		host_receive();
+		host_submit();
+	}
+
+	printf("%s:\n", s->name);
+	for (uint p=0; p<8; p++) {
+		struct sim_port *sp = &sim_ports[p];
+		if (!sp->active)
+			continue;
+		qsort(sp->latencies, sp->num_latencies, sizeof(u32), cmp_u32);
+		printf("\tport %u: %7.2f replies/s %6.2f errors/s  latency p50 %7.2f p99 %7.2f max %7.2f ms",
+			p,
+			(double) sp->replies / sim_seconds,
+			(double) sp->errors / sim_seconds,
+			percentile(sp, 50),
+			percentile(sp, 99),
+			percentile(sp, 100));
+		if (sp->pending_count || sp->overflows)
+			printf("  (%u left waiting, %u overflows)", sp->pending_count, sp->overflows);
+		putchar('\n');
+		if (s->timing && sp->replies)
+			printf("\t\tend of reply to completion %6.0f μs, shortest gap before request %6.0f μs (%u required)\n",
+				sp->eof_sum / sp->replies, slaves[p].min_gap, channels[p/4].inter_frame_gap);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1)
+		sim_seconds = atoi(argv[1]);
+
+	printf("Simulating %u s per scenario (%u buffers, reply delay %u μs, timeout %u ms)\n\n",
+		sim_seconds, MAX_IN_FLIGHT, (uint) sim_delay, sim_timeout);
+	for (uint i=0; i < ARRAY_SIZE(scenarios); i++)
+		run_scenario(&scenarios[i]);
+
+	return 0;
+}
@@ -0,0 +1,28 @@
+/*
+ *	USB-RS485 Switch Bus Simulator -- Replacement of stm32lib's util.h
+ *
+ *	(c) 2022--2023 Martin Mares <mj@ucw.cz>
+ */
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef uint8_t byte;
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int16_t s16;
+typedef int32_t s32;
+typedef int64_t s64;
+typedef unsigned int uint;
+
+#define UNUSED __attribute__((unused))
+#define ARRAY_SIZE(a) (sizeof(a)/sizeof(*(a)))
+#define MIN(a,b) (((a)<(b)) ? (a) : (b))
+#define MAX(a,b) (((a)>(b)) ? (a) : (b))
+
+void debug_printf(const char *fmt, ...) __attribute__((format(printf,1,2)));
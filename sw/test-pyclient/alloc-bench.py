@@ -0,0 +1,119 @@
+#!/usr/bin/env python3
+# Checks that the daemon does not allocate messages on the steady-state request path.
+#
+# Keeps several pipelined requests per client in flight and compares the
+# daemon's counter of message allocations (box register 0x210) before and
+# after the measurement. Works without the switch, too: the daemon then
+# answers all requests with exceptions, but they still pass through the
+# message pool.
+
+import argparse
+import selectors
+import socket
+import struct
+import time
+
+
+def connect(ip, port):
+    sk = socket.create_connection((ip, port))
+    sk.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    return sk
+
+
+def frame(tid, unit, func, addr, count):
+    return struct.pack('>HHHBBHH', tid, 0, 6, unit, func, addr, count)
+
+
+def recv_frame(sk):
+    hdr = b''
+    while len(hdr) < 6:
+        hdr += sk.recv(6 - len(hdr))
+    tid, proto, length = struct.unpack('>HHH', hdr)
+    body = b''
+    while len(body) < length:
+        body += sk.recv(length - len(body))
+    return tid, body
+
+
+def read_allocs(ctrl):
+    ctrl.sendall(frame(0, 1, 4, 0x210, 2))
+    _, body = recv_frame(ctrl)
+    assert body[1] == 4, f'Reading of box registers failed: {body!r}'
+    lo, hi = struct.unpack('>HH', body[3:7])
+    return hi << 16 | lo
+
+
+class Client:
+
+    def __init__(self, ip, port, args):
+        self.sk = connect(ip, port)
+        self.sk.setblocking(False)
+        self.args = args
+        self.tid = 0
+        self.buf = b''
+        self.replies = 0
+        self.exceptions = 0
+        for _ in range(args.depth):
+            self.send()
+
+    def send(self):
+        self.tid = (self.tid + 1) & 0xffff
+        self.sk.sendall(frame(self.tid, self.args.unit, 3, 0, self.args.registers))
+
+    def readable(self):
+        self.buf += self.sk.recv(65536)
+        while len(self.buf) >= 6:
+            length = struct.unpack('>H', self.buf[4:6])[0]
+            if len(self.buf) < 6 + length:
+                break
+            body = self.buf[6:6+length]
+            self.buf = self.buf[6+length:]
+            self.replies += 1
+            if body[1] & 0x80:
+                self.exceptions += 1
+            self.send()
+
+
+def run(clients, seconds):
+    sel = selectors.DefaultSelector()
+    for c in clients:
+        sel.register(c.sk, selectors.EVENT_READ, c)
+    start = sum(c.replies for c in clients)
+    end_time = time.monotonic() + seconds
+    while time.monotonic() < end_time:
+        for key, _ in sel.select(timeout=0.1):
+            key.data.readable()
+    sel.close()
+    return sum(c.replies for c in clients) - start
+
+
+parser = argparse.ArgumentParser(description='Benchmark of message allocations in the daemon')
+parser.add_argument('--ip', default='127.0.0.1', help='address of the daemon')
+parser.add_argument('--port', type=int, default=4300, help='TCP port of the control port (default: 4300)')
+parser.add_argument('--ports', type=int, default=8, help='number of switch ports to use (default: 8)')
+parser.add_argument('--clients', type=int, default=1, help='clients per port (default: 1)')
+parser.add_argument('--depth', type=int, default=8, help='requests in flight per client, keep below MaxQueued (default: 8)')
+parser.add_argument('--unit', type=int, default=1, help='slave address (default: 1)')
+parser.add_argument('--registers', type=int, default=10, help='registers per read (default: 10)')
+parser.add_argument('--warmup', type=float, default=2, help='warm-up time in seconds (default: 2)')
+parser.add_argument('--time', type=float, default=10, help='measured time in seconds (default: 10)')
+args = parser.parse_args()
+
+ctrl = connect(args.ip, args.port)
+allocs_start = read_allocs(ctrl)
+
+clients = [Client(args.ip, args.port + 1 + p, args) for p in range(args.ports) for _ in range(args.clients)]
+run(clients, args.warmup)
+allocs_warm = read_allocs(ctrl)
+replies = run(clients, args.time)
+allocs_end = read_allocs(ctrl)
+
+exceptions = sum(c.exceptions for c in clients)
+print(f'Clients:                   {len(clients)} with {args.depth} requests in flight')
+print(f'Replies:                   {replies} ({replies / args.time:.0f}/s, {exceptions} exceptions in total)')
+print(f'Allocations in warm-up:    {allocs_warm - allocs_start}')
+print(f'Allocations in steady run: {allocs_end - allocs_warm}')
+
+for c in clients:
+    c.sk.close()
+ctrl.close()
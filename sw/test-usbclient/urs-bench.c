@@ -0,0 +1,176 @@
+/*
+ *	USB-RS485 Switch Reply Throughput Test
+ *
+ *	(c) 2022--2023 Martin Mares <mj@ucw.cz>
+ *
+ *	Keeps the switch's window full of register reads and measures how
+ *	fast replies arrive over the bulk IN endpoint. Run it against two
+ *	firmware builds with the same slaves attached to compare them.
+ *	Slaves should be fast (e.g., sw/test-device at 115200 baud) and
+ *	spread over several ports, so that the USB side is the bottleneck.
+ *
+ *	Usage: urs-bench [-b <baud>] [-c <registers>] [-t <seconds>] [-u <unit>] <port>...
+ *	(ports are hardware numbers 0-7)
+ */
+
+#include <ucw/lib.h>
+#include <ucw/unaligned.h>
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <libusb.h>
+
+#include "../firmware/interface.h"
+
+static struct libusb_context *usb_ctxt;
+static struct libusb_device_handle *devh;
+static uint version;			// bcdDevice of the switch
+
+static uint baud_rate = 115200;
+static uint num_registers = 125;
+static uint duration = 10;
+static uint unit = 1;
+static uint ports[8];
+static uint num_ports;
+
+static void open_device(void)
+{
+	int err;
+	libusb_device **devlist;
+	ssize_t devn = libusb_get_device_list(usb_ctxt, &devlist);
+	if (devn < 0)
+		die("Cannot enumerate USB devices: error %d", (int) devn);
+
+	for (ssize_t i=0; i<devn; i++) {
+		struct libusb_device_descriptor desc;
+		libusb_device *dev = devlist[i];
+		if (!libusb_get_device_descriptor(dev, &desc) &&
+		    desc.idVendor == URS485_USB_VENDOR && desc.idProduct == URS485_USB_PRODUCT) {
+			msg(L_INFO, "Found device at usb%d.%d, version %04x", libusb_get_bus_number(dev), libusb_get_device_address(dev), desc.bcdDevice);
+			version = desc.bcdDevice;
+			if (err = libusb_open(dev, &devh))
+				die("Cannot open device: error %d", err);
+			libusb_reset_device(devh);
+			if (err = libusb_claim_interface(devh, 0))
+				die("Cannot claim interface: error %d", err);
+			libusb_free_device_list(devlist, 1);
+			return;
+		}
+	}
+
+	die("No switch found");
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void setup_ports(void)
+{
+	for (uint i=0; i < num_ports; i++) {
+		struct urs485_port_params pp = {
+			.parity = URS485_PARITY_EVEN,
+			.powered = 0,
+		};
+		put_u32_le(&pp.baud_rate, baud_rate);
+		put_u16_le(&pp.request_timeout, 100);
+		uint size = (version >= 0x0301) ? sizeof(pp) : offsetof(struct urs485_port_params, retries);
+		int err = libusb_control_transfer(devh, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR, URS485_CONTROL_SET_PORT_PARAMS, 0, ports[i], (byte *) &pp, size, 1000);
+		if (err < 0)
+			die("Cannot set up port %u: error %d", ports[i], err);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+	while ((opt = getopt(argc, argv, "b:c:t:u:")) >= 0)
+		switch (opt) {
+			case 'b': baud_rate = atoi(optarg); break;
+			case 'c': num_registers = atoi(optarg); break;
+			case 't': duration = atoi(optarg); break;
+			case 'u': unit = atoi(optarg); break;
+			default: die("Usage: urs-bench [-b <baud>] [-c <registers>] [-t <seconds>] [-u <unit>] <port>...");
+		}
+	while (optind < argc && num_ports < ARRAY_SIZE(ports))
+		ports[num_ports++] = atoi(argv[optind++]);
+	if (!num_ports)
+		die("No ports given");
+
+	int err;
+	if (err = libusb_init(&usb_ctxt))
+		die("Cannot initialize libusb: error %d", err);
+	open_device();
+	setup_ports();
+
+	bool batched = (version >= 0x0200);
+	uint hdr_size = (version >= 0x0300) ? URS485_MSGHDR_SIZE : URS485_MSGHDR_SIZE_V2;
+
+	uint credits = 0;
+	uint next_port = 0;
+	u16 next_id = 0;
+	u64 replies = 0, errors = 0, bytes = 0, transfers = 0, packets = 0;
+	double start = now();
+	double end = start + duration;
+
+	while (now() < end) {
+		// Fill the window
+		while (credits) {
+			struct urs485_message m = {
+				.port = ports[next_port],
+				.frame_size = 6,
+				.frame = { unit, 0x03, 0, 0, num_registers >> 8, num_registers & 0xff },
+			};
+			put_u16_le(&m.message_id, next_id++);
+			next_port = (next_port + 1) % num_ports;
+			int sent;
+			if (err = libusb_bulk_transfer(devh, 0x01, (byte *) &m, hdr_size + 6, &sent, 1000))
+				die("Send failed: error %d", err);
+			credits--;
+		}
+
+		// Receive replies
+		byte rr[URS485_MAX_TRANSFER_SIZE];
+		int received;
+		if (err = libusb_bulk_transfer(devh, 0x82, rr, batched ? sizeof(rr) : sizeof(struct urs485_message), &received, 1000)) {
+			if (err == LIBUSB_ERROR_TIMEOUT)
+				continue;
+			die("Receive failed: error %d", err);
+		}
+		transfers++;
+		packets += (received + 63) / 64;
+
+		for (int pos = 0; pos < received; ) {
+			struct urs485_message *m = (struct urs485_message *) (rr + pos);
+			if (received - pos < (int) hdr_size || received - pos < (int) hdr_size + m->frame_size)
+				die("Truncated message in transfer");
+			if (m->port == URS485_PORT_CREDIT && batched)
+				credits += get_u16_le(&m->message_id);
+			else if (m->port == URS485_PORT_WINDOW_OPEN && !batched)
+				credits++;
+			else {
+				credits++;
+				replies++;
+				bytes += m->frame_size;
+				if (m->frame_size < 2 || (m->frame[1] & 0x80))
+					errors++;
+			}
+			pos += hdr_size + m->frame_size;
+			if (!batched)
+				break;
+		}
+	}
+
+	double t = now() - start;
+	printf("Replies:   %llu (%llu errors), %.1f/s\n", (unsigned long long) replies, (unsigned long long) errors, replies / t);
+	printf("Frames:    %.1f kB/s\n", bytes / t / 1000);
+	printf("Transfers: %llu, %.2f packets per transfer\n", (unsigned long long) transfers, transfers ? (double) packets / transfers : 0.);
+	return 0;
+}
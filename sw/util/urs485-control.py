@@ -21,18 +21,21 @@ def cmd_config(args):
         args.parity is not None or
         args.power is not None or
         args.timeout is not None or
+        args.queue_ttl is not None or
+        args.retries is not None or
         args.description is not None):
         return cmd_config_set(args)
 
     ports = parse_port_list(args.p, True)
 
-    print('Port  Descr.    Baud   Parity  Power  Timeout [ms]')
+    print('Port  Descr.    Baud   Parity  Power  Timeout [ms]  Queue TTL [ms]  Retries')
     for port in ports:
-        rr = modbus.read_holding_registers(1, 8, slave=port)
+        rr = modbus.read_holding_registers(1, 10, slave=port)
         check_modbus_error(rr)
         baud, parity, powered, timeout = rr.registers[:4]
         descr = [chr(rr.registers[4+i] >> 8) + chr(rr.registers[4+i] & 0x7f) for i in range(4)]
-        print(f'{port}     {"".join(descr)} {baud*100:6}  {parity_by_number[parity]:4}    {power_by_number[powered]:3}   {timeout:5}')
+        queue_ttl, retries = rr.registers[8:10]
+        print(f'{port}     {"".join(descr)} {baud*100:6}  {parity_by_number[parity]:4}    {power_by_number[powered]:3}   {timeout:5}         {queue_ttl:5}           {retries:2}')
 
 
 def cmd_config_set(args):
@@ -58,6 +61,12 @@ def cmd_config_set(args):
     if not(args.timeout is None or args.timeout in range(1, 65536)):
         die('Timeout out of range')
 
+    if not(args.queue_ttl is None or args.queue_ttl in range(0, 65536)):
+        die('Queue TTL out of range')
+
+    if not(args.retries is None or args.retries in range(0, 6)):
+        die('Retries out of range')
+
     if args.description is not None:
         if len(args.description) > 8:
             die('Description may have at most 8 characters')
@@ -78,6 +87,12 @@ def cmd_config_set(args):
         if args.timeout is not None:
             rr = modbus.write_register(4, args.timeout, slave=port)
             check_modbus_error(rr)
+        if args.queue_ttl is not None:
+            rr = modbus.write_register(9, args.queue_ttl, slave=port)
+            check_modbus_error(rr)
+        if args.retries is not None:
+            rr = modbus.write_register(10, args.retries, slave=port)
+            check_modbus_error(rr)
         if descr is not None:
             regs = [(descr[2*i] << 8) + descr[2*i + 1] for i in range(4)]
             rr = modbus.write_registers(5, regs, slave=port)
@@ -105,6 +120,13 @@ def cmd_status(args):
         'CRC errors',
         'Mismatched',
         'Timeouts',
+        'Retries',
+        'Coalesced',
+        'Cache hits',
+        'Merged',
+        'Expired',
+        'Retransmitted',
+        'Breaker fails',
     ]
 
     table = []
@@ -131,7 +153,7 @@ def cmd_status(args):
             u16(4),
         ]
 
-        rr = modbus.read_input_registers(1, 17, slave=port)
+        rr = modbus.read_input_registers(1, 19, slave=port)
         check_modbus_error(rr)
         regs = rr.registers
 
@@ -145,6 +167,19 @@ def cmd_status(args):
             u32(12),
             u32(14),
             u32(16),
+            u32(18),
+        ])
+
+        rr = modbus.read_input_registers(0x100, 12, slave=port)
+        check_modbus_error(rr)
+        regs = rr.registers
+        out.extend([
+            u32(1),
+            u32(3),
+            u32(5),
+            u32(7),
+            u32(9),
+            u32(11),
         ])
 
         table.append(out)
@@ -168,6 +203,50 @@ def cmd_status_reset(args):
         check_modbus_error(rr)
 
 
+box_stats = [
+    # (label, first register, number of registers)
+    ('TX window stalls', 0x200, 2),
+    ('TX transfer stalls', 0x202, 2),
+    ('Replies measured', 0x204, 2),
+    ('Reply latency sum [us]', 0x206, 2),
+    ('Reply latency max [us]', 0x208, 2),
+    ('Ch. 0 (ports 5-8) busy [ms]', 0x20a, 2),
+    ('Ch. 1 (ports 1-4) busy [ms]', 0x20c, 2),
+    ('Request latency max [us]', 0x20e, 2),
+    ('Messages allocated', 0x210, 2),
+    ('Lost replies', 0x212, 2),
+]
+
+
+def cmd_stats(args):
+    first = box_stats[0][1]
+    last = max(reg + n for _, reg, n in box_stats)
+    rr = modbus.read_input_registers(first, last - first, slave=1)
+    check_modbus_error(rr)
+    regs = rr.registers
+
+    for label, reg, n in box_stats:
+        val = 0
+        for i in reversed(range(n)):
+            val = (val << 16) + regs[reg - first + i]
+        print(f'{label+":":30} {val:>10}')
+
+
+def cmd_breakers(args):
+    print('Port  Unit  Failures  Breaker')
+    for port in parse_port_list(args.p, True):
+        regs = []
+        for first in range(0x300, 0x400, 64):
+            rr = modbus.read_input_registers(first, 64, slave=port)
+            check_modbus_error(rr)
+            regs.extend(rr.registers)
+
+        for unit, val in enumerate(regs):
+            if val:
+                state = 'open' if val & 0x8000 else 'closed'
+                print(f'{port:4}  {unit:4}  {val & 0x7fff:8}  {state}')
+
+
 def cmd_version(args):
     fields = [
         ('Vendor',              0 ),
@@ -332,12 +411,19 @@ p_config.add_argument('--baud', type=int, help='baud rate (1200-115200)')
 p_config.add_argument('--parity', help='parity (none/odd/even)')
 p_config.add_argument('--power', type=int, help='deliver power to the port (0/1)')
 p_config.add_argument('--timeout', type=int, help='reply timeout [ms]')
+p_config.add_argument('--retries', type=int, help='repeat requests with broken replies up to this many times (0-5)')
+p_config.add_argument('--queue-ttl', type=int, help='drop requests queued in the daemon for longer [ms] (0=never)')
 p_config.add_argument('--description', type=str, help='port description (up to 8 characters)')
 
 p_status = sub.add_parser('status', help='show port status')
 p_status.add_argument('-p', help='on which ports to act (e.g., "3,5-7" or "all")')
 p_status.add_argument('--reset', default=False, action='store_true', help='reset statistics')
 
+p_stats = sub.add_parser('stats', help='show statistics of the whole switch')
+
+p_breakers = sub.add_parser('breakers', help='show slaves with failed transactions')
+p_breakers.add_argument('-p', help='on which ports to act (e.g., "3,5-7" or "all")')
+
 p_version = sub.add_parser('version', help='show switch version')
 
 p_scan = sub.add_parser('scan', help='scan devices on a bus')
@@ -361,6 +447,10 @@ try:
         cmd_config(args)
     elif cmd == 'status':
         cmd_status(args)
+    elif cmd == 'stats':
+        cmd_stats(args)
+    elif cmd == 'breakers':
+        cmd_breakers(args)
     elif cmd == 'version':
         cmd_version(args)
     elif cmd == 'scan':